@@ -0,0 +1,524 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "external/chess.hpp"
+#include "fastpopular.hpp"
+
+/// @brief Scanning for sets of characters, a vector of bytes at a time where
+/// SSE2 or AVX2 is available.
+namespace scan {
+
+#if defined(__AVX2__)
+constexpr std::ptrdiff_t width = 32;
+
+/// @brief Bit i is set if p[i] is one of the characters
+template <char... Cs> inline std::uint32_t match(const char *p) {
+  const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i m = _mm256_setzero_si256();
+  ((m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(Cs)))), ...);
+  return static_cast<std::uint32_t>(_mm256_movemask_epi8(m));
+}
+
+constexpr std::uint32_t all = 0xFFFFFFFF;
+#elif defined(__SSE2__)
+constexpr std::ptrdiff_t width = 16;
+
+/// @brief Bit i is set if p[i] is one of the characters
+template <char... Cs> inline std::uint32_t match(const char *p) {
+  const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i m = _mm_setzero_si128();
+  ((m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(Cs)))), ...);
+  return static_cast<std::uint32_t>(_mm_movemask_epi8(m));
+}
+
+constexpr std::uint32_t all = 0xFFFF;
+#endif
+
+/// @brief First character in [p, end) of the set, end if there is none
+template <char... Cs>
+inline const char *find_first_of(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+  for (; end - p >= width; p += width) {
+    if (const std::uint32_t mask = match<Cs...>(p))
+      return p + __builtin_ctz(mask);
+  }
+#endif
+
+  while (p < end && ((*p != Cs) && ...))
+    ++p;
+
+  return p;
+}
+
+/// @brief First character in [p, end) not of the set, end if there is none
+template <char... Cs>
+inline const char *find_first_not_of(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+  for (; end - p >= width; p += width) {
+    if (const std::uint32_t mask = ~match<Cs...>(p) & all)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+
+  while (p < end && ((*p == Cs) || ...))
+    ++p;
+
+  return p;
+}
+
+} // namespace scan
+
+/// @brief Reads a pgn stream in large blocks that each hold complete games.
+class GameBlockReader {
+public:
+  GameBlockReader(std::istream &stream, std::size_t block_size)
+      : stream_(stream), block_size_(block_size) {}
+
+  /// @brief Read the next block of the stream, cut after its last complete
+  /// game. The remainder is kept for the following block. A stream buffer
+  /// may return less data than asked for, e.g. of a pipe, in which case the
+  /// block holds the complete games that have arrived.
+  /// @param block resized as needed, a single game may not fit
+  /// @return the length of the block, 0 at the end of the stream
+  std::size_t read(std::vector<char> &block) {
+    if (block.size() < std::max(block_size_, 2 * carry_.size()))
+      block.resize(std::max(block_size_, 2 * carry_.size()));
+
+    std::size_t len = carry_.size();
+    std::copy(carry_.begin(), carry_.end(), block.begin());
+    carry_.clear();
+
+    while (!eof_) {
+      const std::streamsize got =
+          stream_.rdbuf()->sgetn(block.data() + len, block.size() - len);
+
+      if (got <= 0) {
+        eof_ = true;
+        break;
+      }
+
+      len += got;
+
+      const std::size_t cut = find_last_game_start(block.data(), len);
+
+      // no complete game yet, a single game may fill the block
+      if (cut == 0) {
+        if (len == block.size())
+          block.resize(2 * block.size());
+        continue;
+      }
+
+      carry_.assign(block.data() + cut, block.data() + len);
+      return cut;
+    }
+
+    return len;
+  }
+
+private:
+  std::istream &stream_;
+  const std::size_t block_size_;
+  std::vector<char> carry_;
+  bool eof_ = false;
+};
+
+/// @brief Pgn parser over a contiguous block of memory, e.g. a mapped file or
+/// a block of inflated data. It calls the visitor like chess::pgn::StreamParser
+/// but scans the data with plain pointers, without per character refills, and
+/// passes headers, moves and comments as views into the data where possible.
+class BufferParser {
+public:
+  /// @brief Parse a stream in large blocks of complete games, see
+  /// GameBlockReader.
+  void readGames(std::istream &stream, chess::pgn::Visitor &vis) {
+    GameBlockReader reader(stream, block_size);
+
+    while (const std::size_t len = reader.read(block_))
+      readGames(std::string_view(block_.data(), len), vis);
+  }
+
+  void readGames(std::string_view data, chess::pgn::Visitor &vis) {
+    visitor_ = &vis;
+    p_ = data.data();
+    end_ = data.data() + data.size();
+
+    while (p_ < end_) {
+      p_ = static_cast<const char *>(std::memchr(p_, '[', end_ - p_));
+
+      if (p_ == nullptr)
+        break;
+
+      visitor_->skipPgn(false);
+      visitor_->startPgn();
+
+      if (processHeader())
+        processBody();
+      else
+        onEnd();
+    }
+
+    p_ = end_ = nullptr;
+  }
+
+private:
+  static bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+  void skipSpaces() {
+    // mostly a single space, checked before scanning
+    if (p_ < end_ && is_space(*p_))
+      p_ = scan::find_first_not_of<' ', '\n', '\r', '\t'>(p_ + 1, end_);
+  }
+
+  /// @brief Advance p_ to the end of a token
+  void skipToken() {
+    p_ = scan::find_first_of<' ', '\n', '\r', '\t'>(p_, end_);
+  }
+
+  void advance(std::size_t n = 1) {
+    p_ = std::size_t(end_ - p_) > n ? p_ + n : end_;
+  }
+
+  /// @brief Parse the tags of a game, p_ is at the first '['.
+  /// @return false if the data ends before the moves
+  bool processHeader() {
+    std::string_view key;
+
+    while (true) {
+      while (p_ < end_ && *p_ == '\r')
+        ++p_;
+
+      if (p_ == end_)
+        return false;
+
+      switch (*p_) {
+      case '[': {
+        const char *begin = ++p_;
+        skipToken();
+
+        key = std::string_view(begin, p_ - begin);
+        advance();
+        break;
+      }
+      case '"': {
+        const std::string_view value = readTagValue();
+
+        // skip the closing bracket and an optional carriage return
+        advance();
+        if (p_ < end_ && *p_ == '\r')
+          ++p_;
+
+        if (!visitor_->skip())
+          visitor_->header(key, value);
+
+        advance();
+        break;
+      }
+      case '\n':
+        if (!visitor_->skip())
+          visitor_->startMoves();
+
+        ++p_;
+        return true;
+      default:
+        // not a tag, continue with the moves as the stream parser does
+        if (!visitor_->skip())
+          visitor_->startMoves();
+
+        ++p_;
+        return true;
+      }
+    }
+  }
+
+  /// @brief Read a quoted tag value, p_ is at the opening quote and is left
+  /// after the closing one.
+  std::string_view readTagValue() {
+    const char *begin = ++p_;
+
+    // common case, nothing to unescape
+    p_ = scan::find_first_of<'"', '\\', '\n', '\r'>(p_, end_);
+
+    if (p_ < end_ && *p_ == '"')
+      return std::string_view(begin, p_++ - begin);
+
+    value_.assign(begin, p_);
+    bool backslash = false;
+
+    while (p_ < end_) {
+      const char c = *p_++;
+
+      if (c == '\\') {
+        backslash = true;
+      } else if (c == '"' && !backslash) {
+        break;
+      } else if (c == '\n') {
+        throw chess::pgn::StreamParserException(
+            "Invalid PGN, missing closing quote in header");
+      } else if (c != '\r') {
+        backslash = false;
+        value_ += c;
+      }
+    }
+
+    return value_;
+  }
+
+  /// @brief Parse the moves of a game up to and including its termination.
+  void processBody() {
+    // the game was skipped by its tags
+    if (visitor_->skip()) {
+      skipBody();
+      return;
+    }
+
+    bool is_termination_symbol = false;
+
+    // skip the first move number, a game termination or comments before the
+    // first move
+    while (p_ < end_) {
+      const char c = *p_;
+
+      if (c == ' ' || c == '\r' || is_digit(c)) {
+        ++p_;
+      } else if (c == '-' || c == '*' || c == '/') {
+        is_termination_symbol = true;
+        ++p_;
+      } else if (c == '{') {
+        readComment();
+
+        if (!visitor_->skip())
+          visitor_->move("", comment_);
+
+        clearMove();
+      } else {
+        break;
+      }
+    }
+
+    // game had no moves
+    if (is_termination_symbol) {
+      onEnd();
+      return;
+    }
+
+    skipSpaces();
+
+    while (p_ < end_) {
+      // a new game starts, the current one had no termination
+      if (*p_ == '[') {
+        onEnd();
+        return;
+      }
+
+      // skip move number and dots
+      while (p_ < end_ && (is_space(*p_) || is_digit(*p_)))
+        ++p_;
+
+      while (p_ < end_ && *p_ == '.')
+        ++p_;
+
+      skipSpaces();
+
+      if (parseMove())
+        return;
+
+      if (visitor_->skip()) {
+        skipBody();
+        return;
+      }
+
+      skipSpaces();
+
+      if (p_ == end_)
+        break;
+
+      const char c = *p_;
+      const char next = p_ + 1 < end_ ? p_[1] : '\0';
+
+      if (c == '*') {
+        onEnd();
+        ++p_;
+        return;
+      }
+
+      if (c == '1' && next == '-') {
+        // 1-0
+        advance(2);
+        onEnd();
+        return;
+      }
+
+      if (c == '1' && next == '/') {
+        // 1/2-1/2
+        advance(7);
+        onEnd();
+        return;
+      }
+
+      if (c == '0' && next == '-') {
+        if (p_ + 2 == end_ || p_[2] == '1') {
+          // 0-1
+          advance(3);
+          onEnd();
+          return;
+        }
+
+        // castling written with zeros
+        if (parseMove())
+          return;
+
+        if (visitor_->skip()) {
+          skipBody();
+          return;
+        }
+      }
+    }
+
+    onEnd();
+  }
+
+  /// @brief Skip the rest of a game the visitor is done with, without reading
+  /// its moves. The next game starts with a tag at the beginning of a line,
+  /// which can only be found inside a comment otherwise.
+  void skipBody() {
+    clearMove();
+
+    while (p_ < end_) {
+      p_ = static_cast<const char *>(std::memchr(p_, '[', end_ - p_));
+
+      if (p_ == nullptr) {
+        p_ = end_;
+        break;
+      }
+
+      if (p_[-1] == '\n')
+        break;
+
+      ++p_;
+    }
+
+    onEnd();
+  }
+
+  /// @brief Read a move with its comments and annotations, and pass it on.
+  /// @return true if the data ended and the game was finished
+  bool parseMove() {
+    const char *begin = p_;
+    skipToken();
+
+    move_ = std::string_view(begin, p_ - begin);
+
+    while (p_ < end_) {
+      switch (*p_) {
+      case '{':
+        readComment();
+        break;
+      case '(':
+        skipVariation();
+        break;
+      case '$':
+        skipToken();
+        break;
+      case ' ':
+        skipSpaces();
+        break;
+      default:
+        callVisitorMoveFunction();
+        return false;
+      }
+    }
+
+    onEnd();
+    return true;
+  }
+
+  /// @brief Append a comment to the current one, p_ is at the opening brace
+  /// and is left after the closing one.
+  void readComment() {
+    const char *begin = ++p_;
+    const char *close =
+        static_cast<const char *>(std::memchr(p_, '}', end_ - p_));
+    const char *stop = close != nullptr ? close : end_;
+
+    const std::string_view comment(begin, stop - begin);
+
+    if (comment_.empty()) {
+      comment_ = comment;
+    } else {
+      // several comments are concatenated
+      if (comment_.data() != comment_buffer_.data())
+        comment_buffer_.assign(comment_);
+      comment_buffer_ += comment;
+      comment_ = comment_buffer_;
+    }
+
+    p_ = close != nullptr ? close + 1 : end_;
+  }
+
+  /// @brief Skip a (nested) variation, p_ is at the opening parenthesis.
+  void skipVariation() {
+    int depth = 0;
+
+    while (p_ < end_) {
+      const char c = *p_++;
+
+      if (c == '(') {
+        ++depth;
+      } else if (c == ')' && --depth <= 0) {
+        return;
+      }
+    }
+  }
+
+  void clearMove() {
+    move_ = {};
+    comment_ = {};
+  }
+
+  void callVisitorMoveFunction() {
+    if (!move_.empty()) {
+      if (!visitor_->skip())
+        visitor_->move(move_, comment_);
+
+      clearMove();
+    }
+  }
+
+  void onEnd() {
+    callVisitorMoveFunction();
+    clearMove();
+
+    visitor_->endPgn();
+    visitor_->skipPgn(false);
+  }
+
+  chess::pgn::Visitor *visitor_ = nullptr;
+
+  const char *p_ = nullptr;
+  const char *end_ = nullptr;
+
+  std::string_view move_;
+  std::string_view comment_;
+
+  // storage for values that are not contiguous in the data
+  std::string value_;
+  std::string comment_buffer_;
+
+  static constexpr std::size_t block_size = std::size_t(1) << 22;
+  std::vector<char> block_;
+};
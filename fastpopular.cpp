@@ -3,24 +3,33 @@
 #include <atomic>
 #include <chrono>
 #include <cmath>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <regex>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "external/chess.hpp"
-#include "external/gzip/gzstream.h"
 #include "external/parallel_hashmap/phmap.h"
+#include "bufferparser.hpp"
 #include "external/threadpool.hpp"
+#include "gzindex.hpp"
+#include "legal.hpp"
+#include "metacache.hpp"
+#include "output.hpp"
+#include "prefetch.hpp"
+#include "san.hpp"
+#include "watch.hpp"
 
 namespace fs = std::filesystem;
-using json = nlohmann::json;
 
 using namespace chess;
 
@@ -41,6 +50,41 @@ using fen_map_t = phmap::parallel_flat_hash_map<
 
 fen_map_t fen_map;
 
+/// @brief A SAN move played in a position, given by its zobrist key. The SAN
+/// is packed into an integer, so moves of more than 8 characters are not kept.
+struct TransitionKey {
+  std::uint64_t key;
+  std::uint64_t san;
+
+  bool operator==(const TransitionKey &other) const {
+    return key == other.key && san == other.san;
+  }
+};
+
+struct TransitionHash {
+  std::size_t operator()(const TransitionKey &t) const {
+    return t.key ^ (t.san * 0x9E3779B97F4A7C15ull);
+  }
+};
+
+/// @brief The decoded move and what is needed of the resulting position
+struct Transition {
+  Move move;
+  std::uint64_t key;
+  std::uint8_t pieces;
+  // only known with --omitMates, true otherwise
+  bool has_moves;
+};
+
+// read-mostly map of the moves played in the openings, shared by all threads
+using transition_map_t = phmap::parallel_flat_hash_map<
+    TransitionKey, Transition, TransitionHash, std::equal_to<TransitionKey>,
+    std::allocator<std::pair<const TransitionKey, Transition>>, 8,
+    std::shared_mutex>;
+
+transition_map_t transition_map;
+std::atomic<std::size_t> transition_count = 0;
+
 // map to collect metadata for tests
 using map_meta = std::unordered_map<std::string, TestMetaData>;
 
@@ -53,22 +97,69 @@ namespace analysis {
 /// @brief Magic value for fishtest pgns, ~1.2 million keys
 static constexpr int map_size = 1200000;
 
+/// @brief Settings of the analysis, shared by all threads
+struct Settings {
+  std::string regex_engine;
+  // compiled from regex_engine, if given
+  std::regex engine_regex;
+  bool fix_fens = false;
+  int max_plies = 20;
+  unsigned int count_stop_early = 1;
+  int min_count = 1;
+  bool save_count = false;
+  bool omit_move_counter = false;
+  unsigned int tb_limit = 1;
+  bool omit_mates = false;
+  int min_Elo = 0;
+  std::size_t prefetch = 2;
+  // limit of the moves kept in the transition map, 0 disables it
+  std::size_t max_transitions = std::size_t(1) << 23;
+  bool binary_output = false;
+};
+
+/// @brief Match an engine name against the regex of --matchEngine. A thread
+/// sees the few names of the files it analyses over and over, so it keeps the
+/// results for the names seen last.
+bool match_engine(const std::regex &regex, std::string_view name) {
+  static constexpr std::size_t memo_size = 64;
+  thread_local std::vector<std::pair<std::string, bool>> memo;
+  thread_local std::size_t memo_next = 0;
+
+  for (const auto &[memo_name, match] : memo) {
+    if (memo_name == name)
+      return match;
+  }
+
+  const bool match = std::regex_match(name.begin(), name.end(), regex);
+
+  // replace the oldest result once full
+  if (memo.size() < memo_size) {
+    memo.emplace_back(name, match);
+  } else {
+    memo[memo_next].first.assign(name);
+    memo[memo_next].second = match;
+    memo_next = (memo_next + 1) % memo_size;
+  }
+
+  return match;
+}
+
 /// @brief Analyze a file with pgn games and update the position map, apply
 /// filter if present
 class Analyze : public pgn::Visitor {
 public:
-  Analyze(std::string_view file, const std::string &regex_engine,
-          const std::string &move_counter, const unsigned int count_stop_early,
-          const int max_plies, std::ofstream &out_file, const int min_count,
-          const bool save_count, const bool omit_move_counter,
-          const unsigned int tb_limit, const bool omit_mates, const int min_Elo,
-          std::mutex &progress_output)
-      : file(file), regex_engine(regex_engine), move_counter(move_counter),
-        count_stop_early(count_stop_early), max_plies(max_plies),
-        out_file(out_file), min_count(min_count), save_count(save_count),
-        omit_move_counter(omit_move_counter), tb_limit(tb_limit),
-        omit_mates(omit_mates), min_Elo(min_Elo),
-        progress_output(progress_output) {}
+  Analyze(std::string_view file, const Settings &settings,
+          const std::string &move_counter, OutputWriter &out_file)
+      : file(file), regex_engine(settings.regex_engine),
+        engine_regex(settings.engine_regex),
+        move_counter(move_counter),
+        count_stop_early(settings.count_stop_early),
+        max_plies(settings.max_plies), out_file(out_file),
+        min_count(settings.min_count), save_count(settings.save_count),
+        omit_move_counter(settings.omit_move_counter),
+        tb_limit(settings.tb_limit), omit_mates(settings.omit_mates),
+        min_Elo(settings.min_Elo), max_transitions(settings.max_transitions),
+        binary_output(settings.binary_output) {}
 
   virtual ~Analyze() {}
 
@@ -77,13 +168,14 @@ public:
   void header(std::string_view key, std::string_view value) override {
 
     if (key == "FEN") {
-      std::regex p("0 1$");
-
       // revert change by cutechess-cli of move counters in .epd books to "0 1"
-      if (!move_counter.empty() && std::regex_search(value.data(), p)) {
-        board.setFen(std::regex_replace(value.data(), p, "0 " + move_counter));
+      if (!move_counter.empty() && value.size() >= 3 &&
+          value.substr(value.size() - 3) == "0 1") {
+        fen.assign(value.substr(0, value.size() - 1));
+        fen += move_counter;
+        set_fen(fen);
       } else {
-        board.setFen(value);
+        set_fen(value);
       }
     }
 
@@ -96,26 +188,18 @@ public:
     }
 
     if (key == "White") {
-      white = value;
+      white.assign(value);
     }
 
     if (key == "Black") {
-      black = value;
+      black.assign(value);
     }
 
     if (key == "WhiteElo") {
-      try {
-        whiteElo = std::stoi(std::string(value));
-      } catch (const std::exception &e) {
-        whiteElo = 0;
-      }
+      whiteElo = parse_int(value);
     }
     if (key == "BlackElo") {
-      try {
-        blackElo = std::stoi(std::string(value));
-      } catch (const std::exception &e) {
-        blackElo = 0;
-      }
+      blackElo = parse_int(value);
     }
   }
 
@@ -138,13 +222,11 @@ public:
         return;
       }
 
-      std::regex regex(regex_engine);
-
-      if (std::regex_match(white, regex)) {
+      if (match_engine(engine_regex, white.view())) {
         filter_side = Color::WHITE;
       }
 
-      if (std::regex_match(black, regex)) {
+      if (match_engine(engine_regex, black.view())) {
         if (filter_side == Color::NONE) {
           filter_side = Color::BLACK;
         } else {
@@ -162,24 +244,57 @@ public:
       return;
     }
 
-    try {
-      Move m = uci::parseSan(board, move, moves);
+    Transition next;
+    const std::uint64_t parent_key = position_key();
+
+    // the game follows the transition map up to its first miss
+    const bool cached =
+        max_transitions > 0 && in_transitions && !board.chess960();
+
+    if (cached && find_transition(parent_key, move, next)) {
+      // the board follows once it is needed
+      pending.push_back(next.move);
+      pending_key = next.key;
+    } else {
+      sync_board();
+
+      bool decoded = false;
+
+      try {
+        Move m = san::parse(board, move, moves);
 
-      // chess-lib may call move() with empty strings for move
-      if (m == Move::NO_MOVE) {
+        // chess-lib may call move() with empty strings for move
+        if (m == Move::NO_MOVE) {
+          this->skipPgn(true);
+          return;
+        }
+
+        board.makeMove<true>(m);
+        next.move = m;
+        decoded = true;
+      } catch (const uci::AmbiguousMoveError &e) {
+        std::cerr << "While parsing " << file << " encountered: " << e.what()
+                  << '\n';
         this->skipPgn(true);
-        return;
       }
 
-      board.makeMove<true>(m);
-    } catch (const uci::AmbiguousMoveError &e) {
-      std::cerr << "While parsing " << file << " encountered: " << e.what()
-                << '\n';
-      this->skipPgn(true);
+      next.key = board.hash();
+      next.pieces = board.occ().count();
+      next.has_moves = true;
+
+      if (omit_mates)
+        next.has_moves = legal::has_move(board);
+
+      // each game extends the map by a single move, which keeps it to the
+      // lines played repeatedly
+      if (cached && decoded)
+        add_transition(parent_key, move, next);
+
+      in_transitions = false;
     }
 
     if (tb_limit > 1) {
-      unsigned int piece_count = board.occ().count();
+      unsigned int piece_count = next.pieces;
       if (piece_count <= tb_limit) {
         this->skipPgn(true);
         return;
@@ -187,19 +302,16 @@ public:
     }
 
     if (omit_mates) {
-      Movelist movelist;
-      movegen::legalmoves(movelist, board);
-
-      if (movelist.empty()) {
+      if (!next.has_moves) {
         this->skipPgn(true);
         return;
       }
     }
 
-    if (!do_filter || filter_side == board.sideToMove())
+    if (!do_filter || filter_side == side_to_move())
       if (comment != "book") {
         // std::string fen = board.getFen(false);
-        std::uint64_t key = board.hash();
+        std::uint64_t key = next.key;
         std::uint64_t value;
 
         bool is_new_entry = zobrist_map.lazy_emplace_l(
@@ -212,13 +324,22 @@ public:
 
         if (value == std::uint64_t(min_count)) {
           total_pos++;
+          sync_board();
           if (save_count) {
             PackedBoard fen = Board::Compact::encode(board);
             fen_map.insert(std::pair(key, fen));
+          } else if (binary_output) {
+            BinaryRecord{Board::Compact::encode(board), key, value}.append_to(
+                output);
+
+            if (output.size() >= OutputWriter::block_size)
+              out_file.write(output);
           } else {
-            std::string fen = board.getFen(!omit_move_counter);
-            const std::lock_guard<std::mutex> lock(progress_output);
-            out_file << fen << "\n";
+            output += board.getFen(!omit_move_counter);
+            output += '\n';
+
+            if (output.size() >= OutputWriter::block_size)
+              out_file.write(output);
           }
         }
 
@@ -233,9 +354,14 @@ public:
       }
   }
 
+  /// @brief Hand the positions collected so far to the writer.
+  void flush() { out_file.write(output); }
+
   void endPgn() override {
-    board.set960(false);
-    board.setFen(constants::STARTPOS);
+    board = start_board();
+
+    pending.clear();
+    in_transitions = true;
 
     hasResult = false;
 
@@ -251,22 +377,123 @@ public:
   }
 
 private:
+  /// @brief Board of the start position, copied instead of parsing its FEN
+  static const Board &start_board() {
+    static const Board start(constants::STARTPOS);
+    return start;
+  }
+
+  /// @brief Set up the board from a FEN tag. Games come in pairs of the same
+  /// opening, and books are reused across files, so each thread keeps the
+  /// boards of the FENs seen last and copies them instead of parsing.
+  void set_fen(std::string_view fen_tag) {
+    // castling rights are read differently for chess960
+    if (board.chess960()) {
+      board.setFen(fen_tag);
+      return;
+    }
+
+    static constexpr std::size_t fen_cache_size = 1 << 14;
+    thread_local std::unordered_map<std::string, Board> fen_cache;
+    thread_local std::string key;
+
+    // the key is reused, so that lookups do not allocate
+    key.assign(fen_tag);
+
+    const auto it = fen_cache.find(key);
+
+    if (it != fen_cache.end()) {
+      board = it->second;
+      return;
+    }
+
+    board.setFen(fen_tag);
+
+    if (fen_cache.size() >= fen_cache_size)
+      fen_cache.clear();
+
+    fen_cache.emplace(key, board);
+  }
+
+  /// @brief Key of the current position, the board may lag behind
+  std::uint64_t position_key() const {
+    return pending.empty() ? board.hash() : pending_key;
+  }
+
+  Color side_to_move() const {
+    return pending.size() % 2 ? ~board.sideToMove() : board.sideToMove();
+  }
+
+  /// @brief Play the moves found in the transition map on the board
+  void sync_board() {
+    for (const Move m : pending)
+      board.makeMove<true>(m);
+
+    pending.clear();
+  }
+
+  static bool pack_san(std::string_view move, std::uint64_t &san) {
+    if (move.size() > sizeof(san))
+      return false;
+
+    san = 0;
+    std::memcpy(&san, move.data(), move.size());
+    return true;
+  }
+
+  static bool find_transition(std::uint64_t key, std::string_view move,
+                              Transition &next) {
+    TransitionKey t{key, 0};
+
+    if (!pack_san(move, t.san))
+      return false;
+
+    return transition_map.if_contains(
+        t, [&](const transition_map_t::value_type &p) { next = p.second; });
+  }
+
+  /// @brief Keep a move, unless max_transitions are kept already. A move
+  /// takes up to 80 bytes, as the map keeps up to twice as many slots as
+  /// moves, about 660 MB at the default limit of 8M moves.
+  void add_transition(std::uint64_t key, std::string_view move,
+                      const Transition &next) const {
+    TransitionKey t{key, 0};
+
+    if (transition_count >= max_transitions || !pack_san(move, t.san))
+      return;
+
+    if (transition_map.try_emplace(t, next).second)
+      ++transition_count;
+  }
+
   std::string_view file;
   const std::string &regex_engine;
+  const std::regex &engine_regex;
   const std::string &move_counter;
   const unsigned int count_stop_early;
   const int max_plies;
-  std::ofstream &out_file;
+  OutputWriter &out_file;
+  // positions to be written, handed over in blocks
+  std::string output;
   const int min_count;
   const bool save_count;
   const bool omit_move_counter;
   const unsigned int tb_limit;
   const bool omit_mates;
   const int min_Elo;
-  std::mutex &progress_output;
+  const std::size_t max_transitions;
+  const bool binary_output;
 
   Board board;
   Movelist moves;
+  // FEN with the move counters fixed
+  std::string fen;
+
+  // moves found in the transition map, not yet played on the board, and the
+  // key of the position they lead to
+  std::vector<Move> pending;
+  std::uint64_t pending_key = 0;
+  bool in_transitions = true;
 
   bool skip = false;
 
@@ -275,8 +502,9 @@ private:
   bool do_filter = false;
   Color filter_side = Color::NONE;
 
-  std::string white;
-  std::string black;
+  // engine names, usually short
+  FixedString<64> white;
+  FixedString<64> black;
 
   int whiteElo = 0, blackElo = 0;
 
@@ -284,131 +512,564 @@ private:
   unsigned int new_entry_count = 0;
 };
 
-void ana_files(const std::vector<std::string> &files,
-               const std::string &regex_engine, const map_meta &meta_map,
-               bool fix_fens, const int max_plies,
-               const unsigned int count_stop_early, std::ofstream &out_file,
-               const int min_count, const bool save_count,
-               const bool omit_move_counter, const unsigned int tb_limit,
-               const bool omit_mates, const int min_Elo,
-               std::mutex &progress_output) {
-
-  for (const auto &file : files) {
-    std::string move_counter;
-    if (fix_fens) {
-      fs::path path(file);
-      std::string filename = path.filename().string();
-      std::string test_id = filename.substr(0, filename.find_first_of("-."));
-      std::string test_filename = (path.parent_path() / test_id).string();
-
-      if (meta_map.find(test_filename) == meta_map.end()) {
-        std::cout << "Error: No metadata for test " << test_filename
-                  << std::endl;
+/// @brief Get the move counter to restore in FENs of the given file, empty if
+/// move counters are not fixed.
+/// @param file
+/// @param meta_map
+/// @param fix_fens
+/// @return
+[[nodiscard]] std::string get_move_counter(const std::string &file,
+                                           const map_meta &meta_map,
+                                           bool fix_fens) {
+  std::string move_counter;
+  if (fix_fens) {
+    fs::path path(file);
+    std::string filename = path.filename().string();
+    std::string test_id = filename.substr(0, filename.find_first_of("-."));
+    std::string test_filename = (path.parent_path() / test_id).string();
+
+    if (meta_map.find(test_filename) == meta_map.end()) {
+      std::cout << "Error: No metadata for test " << test_filename
+                << std::endl;
+      std::exit(1);
+    }
+
+    if (meta_map.at(test_filename).book_depth.has_value()) {
+      move_counter =
+          std::to_string(meta_map.at(test_filename).book_depth.value() + 1);
+    } else {
+      if (!meta_map.at(test_filename).book.has_value()) {
+        std::cout << "Error: Missing \"book\" key in metadata for test "
+                  << test_filename << std::endl;
         std::exit(1);
       }
 
-      if (meta_map.at(test_filename).book_depth.has_value()) {
-        move_counter =
-            std::to_string(meta_map.at(test_filename).book_depth.value() + 1);
+      // as the regex ".epd" did, any character followed by "epd"
+      if (meta_map.at(test_filename).book.value().find("epd", 1) !=
+          std::string::npos) {
+        std::cout << "Error: Missing \"book_depth\" key in metadata for .epd "
+                     "book for test "
+                  << test_filename << std::endl;
+        std::exit(1);
+      }
+    }
+  }
+  return move_counter;
+}
+
+/// @brief Analyze all games of a pgn stream or block of memory.
+template <typename Input>
+void ana_games(Input &&input, const std::string &file,
+               const std::string &move_counter, const Settings &settings,
+               OutputWriter &out_file) {
+  // the parser keeps its buffers between files
+  thread_local BufferParser parser;
+
+  Analyze vis(file, settings, move_counter, out_file);
+
+  try {
+    parser.readGames(input, vis);
+  } catch (const std::exception &e) {
+    std::cout << "Error when parsing: " << file << std::endl;
+    std::cerr << e.what() << '\n';
+  }
+
+  vis.flush();
+}
+
+/// @brief Analyze files taken from the shared queue until none are left.
+void ana_files(FileQueue &files, const map_meta &meta_map,
+               const Settings &settings, OutputWriter &out_file,
+               std::mutex &progress_output, Progress &progress,
+               ThreadPool *io_pool) {
+
+  FilePrefetcher prefetcher(files, settings.prefetch, io_pool);
+  FileData prefetched;
+
+  while (prefetcher.next(prefetched)) {
+    const std::string &file = prefetched.path;
+    const std::string move_counter =
+        get_move_counter(file, meta_map, settings.fix_fens);
+
+    const bool is_gz =
+        file.size() >= 3 && file.substr(file.size() - 3) == ".gz";
+
+    if (prefetched.loaded) {
+      const auto &data = prefetched.data;
+
+      if (is_gz) {
+        GzMemoryStream input(data.data(), data.size());
+        ana_games(input, file, move_counter, settings, out_file);
       } else {
-        if (!meta_map.at(test_filename).book.has_value()) {
-          std::cout << "Error: Missing \"book\" key in metadata for test "
-                    << test_filename << std::endl;
-          std::exit(1);
-        }
+        ana_games(std::string_view(data.data(), data.size()), file,
+                  move_counter, settings, out_file);
+      }
+    } else if (is_gz) {
+      GzFileStream input(file);
+      ana_games(input, file, move_counter, settings, out_file);
+    } else {
+      const MappedFile mapped(file);
+      ana_games(std::string_view(mapped.data(), mapped.size()), file,
+                move_counter, settings, out_file);
+    }
+
+    ++total_files;
+
+    progress.file_done(files.file_size(prefetched.index), progress_output);
+  }
+}
+
+/// @brief Block of complete games of a file, passed from the reader to the
+/// parser threads of the pipeline.
+struct GameBlock {
+  std::size_t file = 0;
+  std::vector<char> data;
+  std::size_t size = 0;
+  /// @brief Blocks of the file not parsed yet, and one more while the file is
+  /// still being read. Shared by the blocks of a file in the pipeline.
+  std::shared_ptr<std::atomic<std::size_t>> pending;
+};
 
-        std::regex p(".epd");
+/// @brief Analyze files in a pipeline. io_threads read and inflate the files
+/// into blocks of complete games, which parse_threads take from a bounded
+/// queue and analyze. Block buffers are recycled between the stages.
+void ana_files_pipelined(FileQueue &files, const map_meta &meta_map,
+                         const Settings &settings, OutputWriter &out_file,
+                         std::mutex &progress_output, Progress &progress,
+                         int io_threads, int parse_threads) {
+  static constexpr std::size_t block_size = std::size_t(1) << 21;
+
+  BoundedQueue<GameBlock> blocks(2 * parse_threads);
+
+  std::mutex free_mutex;
+  std::vector<std::vector<char>> free_buffers;
+
+  const auto get_buffer = [&]() {
+    const std::lock_guard<std::mutex> lock(free_mutex);
+    if (free_buffers.empty())
+      return std::vector<char>(block_size);
+    std::vector<char> buffer = std::move(free_buffers.back());
+    free_buffers.pop_back();
+    return buffer;
+  };
+
+  const auto put_buffer = [&](std::vector<char> buffer) {
+    const std::lock_guard<std::mutex> lock(free_mutex);
+    free_buffers.push_back(std::move(buffer));
+  };
+
+  // the file is done once its last block is parsed, or once it is read if
+  // all blocks were parsed before
+  const auto block_done = [&](const GameBlock &block) {
+    if (--*block.pending > 0)
+      return;
+
+    ++total_files;
+
+    progress.file_done(files.file_size(block.file), progress_output);
+  };
 
-        if (std::regex_search(meta_map.at(test_filename).book.value(), p)) {
-          std::cout << "Error: Missing \"book_depth\" key in metadata for .epd "
-                       "book for test "
-                    << test_filename << std::endl;
-          std::exit(1);
+  const auto read_files = [&]() {
+    std::size_t i;
+
+    while (files.next(i)) {
+      const std::string &file = files[i];
+      const bool is_gz =
+          file.size() >= 3 && file.substr(file.size() - 3) == ".gz";
+
+      std::unique_ptr<std::istream> input;
+      if (is_gz)
+        input = std::make_unique<GzFileStream>(file);
+      else
+        input = std::make_unique<std::ifstream>(file, std::ios::binary);
+
+      GameBlockReader reader(*input, block_size);
+      const auto pending = std::make_shared<std::atomic<std::size_t>>(1);
+
+      while (true) {
+        GameBlock block;
+        block.file = i;
+        block.data = get_buffer();
+        block.size = reader.read(block.data);
+
+        if (block.size == 0) {
+          put_buffer(std::move(block.data));
+          block.pending = pending;
+          block_done(block);
+          break;
         }
+
+        ++*pending;
+        block.pending = pending;
+        blocks.push(std::move(block));
       }
     }
+  };
 
-    const auto pgn_iterator = [&](std::istream &iss) {
-      auto vis = std::make_unique<Analyze>(
-          file, regex_engine, move_counter, count_stop_early, max_plies,
-          out_file, min_count, save_count, omit_move_counter, tb_limit,
-          omit_mates, min_Elo, progress_output);
+  const auto parse_blocks = [&]() {
+    GameBlock block;
 
-      pgn::StreamParser parser(iss);
+    while (blocks.pop(block)) {
+      const std::string &file = files[block.file];
 
-      try {
-        parser.readGames(*vis);
-      } catch (const std::exception &e) {
-        std::cout << "Error when parsing: " << file << std::endl;
-        std::cerr << e.what() << '\n';
-      }
-    };
+      ana_games(std::string_view(block.data.data(), block.size), file,
+                get_move_counter(file, meta_map, settings.fix_fens), settings,
+                out_file);
 
-    if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz") {
-      igzstream input(file.c_str());
-      pgn_iterator(input);
-    } else {
-      std::ifstream pgn_stream(file);
-      pgn_iterator(pgn_stream);
-      pgn_stream.close();
+      put_buffer(std::move(block.data));
+      block_done(block);
     }
+  };
 
-    ++total_files;
+  ThreadPool parsers(parse_threads);
+  for (int i = 0; i < parse_threads; ++i)
+    parsers.enqueue(parse_blocks);
+
+  ThreadPool readers(io_threads);
+  for (int i = 0; i < io_threads; ++i)
+    readers.enqueue(read_files);
+
+  readers.wait();
+  blocks.close();
+  parsers.wait();
+}
+
+/// @brief Analyze the games of a single plain pgn file with all threads of
+/// the pool, splitting it into byte ranges that start at game boundaries.
+void ana_pgn_parallel(const std::string &file, const map_meta &meta_map,
+                      const Settings &settings, OutputWriter &out_file,
+                      std::mutex &progress_output, ThreadPool &pool,
+                      int target_chunks) {
+  const std::string move_counter =
+      get_move_counter(file, meta_map, settings.fix_fens);
+  // the threads read different parts, so the pages are not faulted in upfront
+  const MappedFile mapped(file, false);
+  const std::string_view data(mapped.data(), mapped.size());
+  const std::uint64_t size = data.size();
+  const std::uint64_t chunk_size = std::max<std::uint64_t>(
+      std::uint64_t(1) << 22, (size + target_chunks - 1) / target_chunks);
+  const std::uint64_t chunks = std::max<std::uint64_t>(
+      1, (size + chunk_size - 1) / chunk_size);
+
+  std::atomic<std::size_t> ranges_done = 0;
+
+  for (std::uint64_t begin = 0; begin < size; begin += chunk_size) {
+    const std::uint64_t end = std::min(begin + chunk_size, size);
+
+    pool.enqueue([&, begin, end]() {
+      const std::size_t first = find_game_start(data, begin);
+      const std::size_t last = find_game_start(data, end);
+
+      ana_games(data.substr(first, std::max(first, last) - first), file,
+                move_counter, settings, out_file);
+
+      ++ranges_done;
+
+      const std::lock_guard<std::mutex> lock(progress_output);
+      std::cout << "\rProcessed " << ranges_done << " of " << chunks
+                << " ranges of " << file << std::flush;
+    });
+  }
+
+  pool.wait();
+
+  ++total_files;
+}
+
+/// @brief Analyze the games of a single .gz file with all threads of the
+/// pool. The file is split at the access points of a zlib index, each range
+/// is inflated and parsed separately, starting at its first game. Ranges are
+/// enqueued while the index is still being built.
+void ana_gz_parallel(const std::string &file, const map_meta &meta_map,
+                     const Settings &settings, bool cache_index,
+                     OutputWriter &out_file, std::mutex &progress_output,
+                     ThreadPool &pool) {
+  const std::string move_counter =
+      get_move_counter(file, meta_map, settings.fix_fens);
+  const std::string index_file = file + ".fpidx";
+
+  std::atomic<std::size_t> ranges_done = 0;
+
+  const auto enqueue_range = [&](const GzAccessPoint &point,
+                                 std::uint64_t end) {
+    pool.enqueue([&, point, end]() {
+      GzRangeStream input(file, point, end);
+      ana_games(input, file, move_counter, settings, out_file);
+
+      ++ranges_done;
 
-    // Limit the scope of the lock
-    {
       const std::lock_guard<std::mutex> lock(progress_output);
+      std::cout << "\rProcessed " << ranges_done << " ranges of " << file
+                << std::flush;
+    });
+  };
+
+  GzIndex index;
+
+  if (cache_index && index.load(index_file, file)) {
+    std::cout << "Loaded index with " << index.points.size()
+              << " access points from " << index_file << std::endl;
+
+    for (std::size_t i = 0; i < index.points.size(); ++i) {
+      const bool last = i + 1 == index.points.size();
+      enqueue_range(index.points[i],
+                    last ? GzRangeStream::npos : index.points[i + 1].out);
+    }
+  } else {
+    const std::uint64_t span = std::max<std::uint64_t>(
+        std::uint64_t(1) << 22, fs::file_size(file) / 256);
+
+    const bool ok = index.build(file, span, [&](const GzIndex &idx) {
+      // a range ends where the next one starts, so the previous access point
+      // is complete once a new one is found
+      if (idx.points.size() > 1)
+        enqueue_range(idx.points[idx.points.size() - 2],
+                      idx.points.back().out);
+    });
+
+    if (!index.points.empty())
+      enqueue_range(index.points.back(), GzRangeStream::npos);
+
+    if (!ok) {
+      std::cout << "Error: failed to index " << file
+                << ", the file may be truncated or corrupt" << std::endl;
+    } else if (cache_index && !index.save(index_file, file)) {
+      std::cout << "Warning: could not write index " << index_file
+                << std::endl;
+    }
+  }
 
-      // Print progress
-      std::cout << "\rProcessed " << total_files << " files" << std::flush;
+  pool.wait();
+
+  ++total_files;
+}
+
+/// @brief Analyze a pgn stream that can only be read once, e.g. stdin or a
+/// named pipe. The stream is read in batches of complete games, which the
+/// threads take from a bounded queue and analyze.
+void ana_stream(std::istream &input, const std::string &file,
+                const map_meta &meta_map, const Settings &settings,
+                OutputWriter &out_file, std::mutex &progress_output,
+                int threads) {
+  static constexpr std::size_t block_size = std::size_t(1) << 21;
+
+  const std::string move_counter =
+      get_move_counter(file, meta_map, settings.fix_fens);
+
+  BoundedQueue<GameBlock> blocks(2 * threads);
+  BoundedQueue<std::vector<char>> free_buffers(4 * threads);
+  std::atomic<std::uint64_t> bytes_done = 0;
+
+  const auto parse_blocks = [&]() {
+    GameBlock block;
+
+    while (blocks.pop(block)) {
+      ana_games(std::string_view(block.data.data(), block.size), file,
+                move_counter, settings, out_file);
+
+      const std::uint64_t done = bytes_done += block.size;
+
+      {
+        const std::lock_guard<std::mutex> lock(progress_output);
+        std::cout << "\rProcessed " << done / 1000000 << " MB of " << file
+                  << std::flush;
+      }
+
+      free_buffers.push(std::move(block.data));
     }
+  };
+
+  ThreadPool parsers(threads);
+  for (int i = 0; i < threads; ++i)
+    parsers.enqueue(parse_blocks);
+
+  GameBlockReader reader(input, block_size);
+  std::size_t buffers = 0;
+
+  while (true) {
+    GameBlock block;
+
+    // recycle the buffers of parsed blocks once enough are in use
+    if (buffers < 4 * std::size_t(threads))
+      ++buffers;
+    else
+      free_buffers.pop(block.data);
+
+    block.size = reader.read(block.data);
+
+    if (block.size == 0)
+      break;
+
+    blocks.push(std::move(block));
   }
+
+  blocks.close();
+  parsers.wait();
+
+  ++total_files;
 }
 
 } // namespace analysis
 
-[[nodiscard]] map_meta get_metadata(const std::vector<std::string> &file_list,
-                                    bool allow_duplicates) {
-  map_meta meta_map;
-  std::unordered_map<std::string, std::string>
-      test_map; // map to check for duplicate tests
-  std::set<std::string> test_warned;
-  for (const auto &pathname : file_list) {
+/// @brief Detects "duplicate" files, i.e. "foo.pgn.gz" and "foo.pgn", and tests
+/// found in several directories. Files can be added while they are found.
+class DuplicateCheck {
+public:
+  explicit DuplicateCheck(bool allow_duplicates)
+      : allow_duplicates_(allow_duplicates) {}
+
+  /// @brief Check a file against the files added before
+  /// @return false on duplicates, unless they are allowed
+  [[nodiscard]] bool add(const std::string &pathname) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+
+    const bool is_gz =
+        pathname.size() >= 3 && pathname.substr(pathname.size() - 3) == ".gz";
+    const std::string other = is_gz
+                                  ? pathname.substr(0, pathname.size() - 3)
+                                  : pathname + ".gz";
+
+    if (files_.find(other) != files_.end()) {
+      std::cout << "Error: \"Duplicate\" files: "
+                << (is_gz ? other : pathname) << " and "
+                << (is_gz ? pathname : other) << std::endl;
+      failed_ = true;
+      return false;
+    }
+
+    files_.insert(pathname);
+
     fs::path path(pathname);
     std::string filename = path.filename().string();
     std::string test_id = filename.substr(0, filename.find_first_of("-."));
     std::string test_filename = (path.parent_path() / test_id).string();
 
-    if (test_map.find(test_id) == test_map.end()) {
-      test_map[test_id] = test_filename;
-    } else if (test_map[test_id] != test_filename) {
-      if (test_warned.find(test_filename) == test_warned.end()) {
-        std::cout << (allow_duplicates ? "Warning" : "Error")
+    if (test_map_.find(test_id) == test_map_.end()) {
+      test_map_[test_id] = test_filename;
+    } else if (test_map_[test_id] != test_filename) {
+      if (test_warned_.find(test_filename) == test_warned_.end()) {
+        std::cout << (allow_duplicates_ ? "Warning" : "Error")
                   << ": Detected a duplicate of test " << test_id
                   << " in directory " << path.parent_path().string()
                   << std::endl;
-        test_warned.insert(test_filename);
+        test_warned_.insert(test_filename);
 
-        if (!allow_duplicates) {
+        if (!allow_duplicates_) {
           std::cout << "Use --allowDuplicates to continue nonetheless."
                     << std::endl;
-          std::exit(1);
+          failed_ = true;
+          return false;
         }
       }
     }
 
-    // load the JSON data from disk, only once for each test
-    if (meta_map.find(test_filename) == meta_map.end()) {
-      std::ifstream json_file(test_filename + ".json");
+    return true;
+  }
+
+  /// @brief Check if duplicates were found that are not allowed
+  [[nodiscard]] bool failed() const { return failed_; }
+
+private:
+  const bool allow_duplicates_;
+  std::atomic<bool> failed_ = false;
+  std::set<std::string> files_;
+  // map to check for duplicate tests
+  std::unordered_map<std::string, std::string> test_map_;
+  std::set<std::string> test_warned_;
+  std::mutex mutex_;
+};
+
+/// @brief Load the metadata of the tests of the given files, in parallel.
+/// @param cache_file if not empty, metadata of unchanged .json files is taken
+/// from this cache, which is then updated with the tests of the files
+[[nodiscard]] map_meta get_metadata(const std::vector<std::string> &file_list,
+                                    int concurrency,
+                                    const std::string &cache_file) {
+  // load the JSON data from disk, only once for each test
+  std::vector<std::string> tests;
+  std::set<std::string> tests_seen;
+  for (const auto &pathname : file_list) {
+    fs::path path(pathname);
+    std::string filename = path.filename().string();
+    std::string test_id = filename.substr(0, filename.find_first_of("-."));
+    std::string test_filename = (path.parent_path() / test_id).string();
+
+    if (tests_seen.insert(test_filename).second)
+      tests.push_back(test_filename);
+  }
+
+  MetaDataCache cache;
+  if (!cache_file.empty())
+    cache.load(cache_file);
+
+  std::vector<std::optional<TestMetaData>> metadata(tests.size());
+  std::vector<MetaDataCache::Entry> stamps(tests.size());
+  // tests whose metadata was read from the .json file rather than the cache
+  std::vector<char> loaded(tests.size(), false);
+  std::atomic<std::size_t> next_test = 0;
+
+  ThreadPool pool(concurrency);
+  for (int i = 0; i < concurrency; ++i) {
+    pool.enqueue([&]() {
+      for (std::size_t t = next_test++; t < tests.size(); t = next_test++) {
+        const std::string json_file = tests[t] + ".json";
+
+        if (!cache_file.empty()) {
+          if (!MetaDataCache::stamp(json_file, stamps[t].size, stamps[t].time))
+            continue;
+
+          if (const auto *meta =
+                  cache.find(json_file, stamps[t].size, stamps[t].time)) {
+            metadata[t] = *meta;
+            continue;
+          }
+        }
 
-      if (!json_file.is_open())
-        continue;
+        metadata[t] = load_metadata(json_file);
+        loaded[t] = metadata[t].has_value();
+      }
+    });
+  }
+  pool.wait();
 
-      json metadata = json::parse(json_file);
+  map_meta meta_map;
+  for (std::size_t t = 0; t < tests.size(); ++t) {
+    if (metadata[t].has_value())
+      meta_map[tests[t]] = *metadata[t];
+  }
+
+  // without files, as for a directory searched while it is analysed, there
+  // is nothing to add and no way to tell which tests are still around
+  if (cache_file.empty() || tests.empty())
+    return meta_map;
+
+  // add the tests read, and drop the tests whose .json file is gone
+  std::size_t changes = 0;
 
-      meta_map[test_filename] = metadata.get<TestMetaData>();
+  for (std::size_t t = 0; t < tests.size(); ++t) {
+    if (loaded[t]) {
+      stamps[t].meta = *metadata[t];
+      cache.entries[tests[t] + ".json"] = std::move(stamps[t]);
+      ++changes;
     }
   }
+
+  for (auto it = cache.entries.begin(); it != cache.entries.end();) {
+    std::error_code ec;
+
+    if (fs::exists(it->first, ec) || ec) {
+      ++it;
+      continue;
+    }
+
+    it = cache.entries.erase(it);
+    ++changes;
+  }
+
+  if (changes > 0 && !cache.save(cache_file))
+    std::cout << "Warning: Cannot write the metadata cache " << cache_file
+              << std::endl;
+
   return meta_map;
 }
 
@@ -461,37 +1122,74 @@ void filter_files_sprt(std::vector<std::string> &file_list,
                   file_list.end());
 }
 
-void process(const std::vector<std::string> &files_pgn,
-             const std::string &regex_engine, const map_meta &meta_map,
-             bool fix_fens, const int max_plies,
-             const unsigned int count_stop_early, std::ofstream &out_file,
-             const int min_count, const bool save_count,
-             const bool omit_move_counter, const unsigned int tb_limit,
-             const bool omit_mates, int min_Elo, int concurrency) {
-  // Create more chunks than threads to prevent threads from idling.
+/// @brief Analyze the files of the queue, which may still be filled while the
+/// analysis runs.
+void process(FileQueue &files, const map_meta &meta_map,
+             const analysis::Settings &settings,
+             bool cache_index, OutputWriter &out_file, int concurrency,
+             int io_threads, int parse_threads) {
+  // Mutex for progress output
+  std::mutex progress_output;
+
+  // Create more ranges than threads to prevent threads from idling.
   int target_chunks = 4 * concurrency;
 
-  auto files_chunked = split_chunks(files_pgn, target_chunks);
+  // A single file is split into ranges of its own.
+  if (files.closed() && files.size() == 1 && concurrency > 1) {
+    const std::string &file = files[0];
+    ThreadPool pool(concurrency);
 
-  std::cout << "Found " << files_pgn.size() << " .pgn(.gz) files, creating "
-            << files_chunked.size() << " chunks for processing." << std::endl;
+    if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz") {
+      std::cout << "Found 1 .pgn.gz file, inflating it with " << concurrency
+                << " threads." << std::endl;
 
-  // Mutex for progress output
-  std::mutex progress_output;
+      analysis::ana_gz_parallel(file, meta_map, settings, cache_index,
+                                out_file, progress_output, pool);
+    } else {
+      std::cout << "Found 1 .pgn file, splitting it for " << concurrency
+                << " threads." << std::endl;
 
-  // Create a thread pool
-  ThreadPool pool(concurrency);
+      analysis::ana_pgn_parallel(file, meta_map, settings, out_file,
+                                 progress_output, pool, target_chunks);
+    }
+    return;
+  }
+
+  Progress progress(files);
+
+  if (files.closed())
+    std::cout << "Found " << files.size() << " .pgn(.gz) files, ";
+  else
+    std::cout << "Searching for .pgn(.gz) files, ";
+
+  // Reading and parsing are done by separate threads.
+  if (io_threads > 0 && parse_threads > 0) {
+    std::cout << "reading with " << io_threads << " and parsing with "
+              << parse_threads << " threads." << std::endl;
+
+    analysis::ana_files_pipelined(files, meta_map, settings, out_file,
+                                  progress_output, progress, io_threads,
+                                  parse_threads);
+    return;
+  }
 
-  for (const auto &files : files_chunked) {
+  std::cout << "processing them with " << concurrency << " threads."
+            << std::endl;
 
-    pool.enqueue([&files, &regex_engine, &meta_map, &fix_fens, &progress_output,
-                  &files_chunked, &max_plies, &count_stop_early, &out_file,
-                  &min_count, &save_count, omit_move_counter, &tb_limit,
-                  &omit_mates, &min_Elo]() {
-      analysis::ana_files(files, regex_engine, meta_map, fix_fens, max_plies,
-                          count_stop_early, out_file, min_count, save_count,
-                          omit_move_counter, tb_limit, omit_mates, min_Elo,
-                          progress_output);
+  // Without io_uring files are read ahead by a pool of their own
+  std::unique_ptr<ThreadPool> io_pool;
+
+  if (settings.prefetch > 0 && !FilePrefetcher::uses_io_uring())
+    io_pool = std::make_unique<ThreadPool>(concurrency);
+
+  // Create a thread pool, each thread takes the next file once it is done
+  ThreadPool pool(concurrency);
+
+  for (int i = 0; i < concurrency; ++i) {
+    pool.enqueue([&files, &meta_map, &settings, &out_file, &progress_output,
+                  &progress, &io_pool]() {
+      analysis::ana_files(files, meta_map, settings, out_file,
+                          progress_output, progress, io_pool.get());
     });
   }
 
@@ -499,17 +1197,100 @@ void process(const std::vector<std::string> &files_pgn,
   pool.wait();
 }
 
+/// @brief Write the retained positions with their counts, also while the
+/// analysis still updates them.
+void write_counts(OutputWriter &out_file, bool binary_output) {
+  std::string output;
+
+  fen_map.for_each([&](const fen_map_t::value_type &pair) {
+    std::uint64_t count = 0;
+    zobrist_map.if_contains(
+        pair.first,
+        [&](const zobrist_map_t::value_type &entry) { count = entry.second; });
+
+    if (binary_output) {
+      BinaryRecord{pair.second, pair.first, count}.append_to(output);
+    } else {
+      output += Board::Compact::decode(pair.second).getFen(false);
+      output += " ; c0 ";
+      output += std::to_string(count);
+      output += '\n';
+    }
+
+    if (output.size() >= OutputWriter::block_size)
+      out_file.write(output);
+  });
+
+  out_file.write(output);
+}
+
+/// @brief Replace the output file by the positions retained so far with their
+/// counts. The snapshot is written next to it and renamed, so readers always
+/// see a complete file.
+/// @return false if the snapshot could not be written, the file is then kept
+bool write_snapshot(const std::string &filename, bool binary_output) {
+  // keep the .gz suffix, which selects the compression of the OutputWriter
+  const bool is_gz =
+      filename.size() >= 3 && filename.substr(filename.size() - 3) == ".gz";
+  const std::string snapshot_file =
+      is_gz ? filename.substr(0, filename.size() - 3) + ".tmp.gz"
+            : filename + ".tmp";
+
+  {
+    OutputWriter snapshot(snapshot_file);
+
+    if (!snapshot.is_open()) {
+      std::cout << "Warning: Cannot write snapshot " << snapshot_file
+                << std::endl;
+      return false;
+    }
+
+    if (binary_output) {
+      std::string header;
+      BinaryRecord::append_header(header);
+      snapshot.write(header);
+    }
+
+    write_counts(snapshot, binary_output);
+
+    if (!snapshot.close()) {
+      std::cout << "Warning: Cannot write snapshot " << snapshot_file
+                << std::endl;
+      std::error_code ec;
+      fs::remove(snapshot_file, ec);
+      return false;
+    }
+  }
+
+  std::error_code ec;
+  fs::rename(snapshot_file, filename, ec);
+
+  if (ec) {
+    std::cout << "Warning: Cannot replace " << filename << " by the snapshot"
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
 void print_usage(char const *program_name) {
   std::stringstream ss;
 
   // clang-format off
     ss << "Usage: " << program_name << " [options]" << "\n";
     ss << "Options:" << "\n";
-    ss << "  --file <path>         Path to .pgn(.gz) file" << "\n";
+    ss << "  --file <path>         Path to .pgn(.gz) file, a named pipe, or - to read games from stdin" << "\n";
     ss << "  --dir <path>          Path to directory containing .pgn(.gz) files (default: pgns)" << "\n";
     ss << "  -r                    Search for .pgn(.gz) files recursively in subdirectories" << "\n";
+    ss << "  --cacheIndex          Store the index used to split a single .pgn.gz file among threads next to it (<file>.fpidx), and reuse it" << "\n";
+    ss << "  --cacheMeta           Store the metadata of the tests in the directory searched (.fpmeta), and reuse it while the .json files are unchanged" << "\n";
     ss << "  --allowDuplicates     Allow duplicate directories for test pgns" << "\n";
     ss << "  --concurrency <N>     Number of concurrent threads to use (default: maximum)" << "\n";
+    ss << "  --ioThreads <N>       Use separate threads to read and inflate files, N of them (default: concurrency / 4 with --parseThreads)" << "\n";
+    ss << "  --parseThreads <N>    Number of threads to analyse the games read by the --ioThreads (default: concurrency with --ioThreads)" << "\n";
+    ss << "  --prefetch <N>        Number of upcoming files each thread reads ahead, with io_uring where available (default: 2, at most 64, 0 disables)" << "\n";
+    ss << "  --maxTransitions <N>  Number of opening moves kept decoded and shared by the threads, up to 80 bytes each (default: 8388608, about 660 MB, 0 disables)" << "\n";
     ss << "  --matchEngine <regex> Filter data based on engine name" << "\n";
     ss << "  --matchBook <regex>   Filter data based on book name" << "\n";
     ss << "  --matchBookInvert     Invert the filter" << "\n";
@@ -525,13 +1306,25 @@ void print_usage(char const *program_name) {
     ss << "  --omitMates           Omit positions without a legal move (check/stale mates)" << "\n";
     ss << "  --minElo <N>          Omit games where WhiteElo or BlackElo < minElo (default: 0)" << "\n";
     ss << "  --cdb                 Shorthand for --TBlimit 7 --omitMates" << "\n";
-    ss << "  -o <path>             Path to output epd file (default: popular.epd)" << "\n";
+    ss << "  -o <path>             Path to output epd file, compressed if it ends in .gz (default: popular.epd)" << "\n";
+    ss << "  --snapshot <N>        Every N seconds, flush the output, or with --saveCount replace it by the positions retained so far (default: 0, off)" << "\n";
+    ss << "  --watch               Keep watching the directory (inotify) and analyse new .pgn(.gz) files as they are written, until interrupted (implies --snapshot 60)" << "\n";
+    ss << "  --binary              Write binary records of positions, zobrist keys and counts instead of FENs, see Readme.md" << "\n";
     ss << "  --help                Print this help message" << "\n";
   // clang-format on
 
   std::cout << ss.str();
 }
 
+/// @brief Set by SIGINT or SIGTERM, ends watching the directory
+std::atomic<bool> stop_watching = false;
+
+void on_stop_signal(int signal) {
+  stop_watching = true;
+  // a second signal terminates at once
+  std::signal(signal, SIG_DFL);
+}
+
 /// @brief
 /// @param argc
 /// @param argv See print_usage() for possible arguments
@@ -558,39 +1351,119 @@ int main(int argc, char const *argv[]) {
     concurrency = std::stoi(*std::next(pos));
   }
 
+  // a pipeline of reader and parser threads is used if either count is given
+  int io_threads = 0, parse_threads = 0;
+
+  if (find_argument(args, pos, "--ioThreads")) {
+    io_threads = std::max(1, std::stoi(*std::next(pos)));
+  }
+
+  if (find_argument(args, pos, "--parseThreads")) {
+    parse_threads = std::max(1, std::stoi(*std::next(pos)));
+  }
+
+  if (io_threads > 0 || parse_threads > 0) {
+    if (parse_threads == 0)
+      parse_threads = concurrency;
+    if (io_threads == 0)
+      io_threads = std::max(1, concurrency / 4);
+  }
+
+  bool allow_duplicates = find_argument(args, pos, "--allowDuplicates", true);
+  DuplicateCheck duplicates(allow_duplicates);
+
+  bool fix_fens = find_argument(args, pos, "--fixFEN", true);
+  bool sprt_only = find_argument(args, pos, "--SPRTonly", true);
+
+  if (find_argument(args, pos, "--matchBook")) {
+    regex_book = *std::next(pos);
+  }
+
+  // the directory to search, files of a directory are analysed while it is
+  // still being searched, unless they are filtered by the test metadata first
+  std::string path;
+  bool recursive = false;
+  bool stream_files = false;
+  std::unordered_map<std::string, std::uint64_t> file_sizes;
+  // keep watching the directory for new files once it has been searched
+  bool watch = find_argument(args, pos, "--watch", true);
+#ifdef FASTPOPULAR_INOTIFY
+  std::unique_ptr<DirectoryWatcher> watcher;
+#endif
+
+  // a stream that can only be read once, stdin or a named pipe
+  bool stream_input = false;
+
+  if (watch && fix_fens) {
+    // the metadata of new tests could not be added while it is read
+    std::cout << "Error: --watch cannot be combined with --fixFEN" << std::endl;
+    std::exit(1);
+  }
+
   if (find_argument(args, pos, "--file")) {
+    if (watch) {
+      std::cout << "Error: --watch requires --dir" << std::endl;
+      std::exit(1);
+    }
+
     files_pgn = {*std::next(pos)};
-    if (!fs::exists(files_pgn[0])) {
+    stream_input = files_pgn[0] == "-" || fs::is_fifo(files_pgn[0]);
+
+    if (!stream_input && !fs::exists(files_pgn[0])) {
       std::cout << "Error: File not found: " << files_pgn[0] << std::endl;
       std::exit(1);
     }
   } else {
-    std::string path = "./pgns";
+    path = "./pgns";
 
     if (find_argument(args, pos, "--dir")) {
       path = *std::next(pos);
     }
 
-    bool recursive = find_argument(args, pos, "-r", true);
+    // subdirectories that cannot be read are skipped, the directory given
+    // must exist
+    std::error_code ec;
+    if (!fs::is_directory(path, ec)) {
+      std::cout << "Error: Directory not found: " << path << std::endl;
+      std::exit(1);
+    }
+
+    recursive = find_argument(args, pos, "-r", true);
     std::cout << "Looking " << (recursive ? "(recursively) " : "")
               << "for pgn files in " << path << std::endl;
 
-    files_pgn = get_files(path, recursive);
+    stream_files = !fix_fens && !sprt_only && regex_book.empty();
+
+#ifdef FASTPOPULAR_INOTIFY
+    // watch before searching, so no file is missed in between
+    if (watch)
+      watcher = std::make_unique<DirectoryWatcher>(path, recursive);
+
+    if (watcher && !watcher->is_open()) {
+      std::cout << "Error: Cannot watch directory " << path << std::endl;
+      std::exit(1);
+    }
+#else
+    if (watch) {
+      std::cout << "Error: --watch is not supported on this platform"
+                << std::endl;
+      std::exit(1);
+    }
+#endif
+
+    if (!stream_files)
+      files_pgn = get_files(path, recursive, concurrency, &file_sizes);
   }
 
-  // sort to easily check for "duplicate" files, i.e. "foo.pgn.gz" and "foo.pgn"
+  // sort for a deterministic order of the checks
   std::sort(files_pgn.begin(), files_pgn.end());
 
-  for (size_t i = 1; i < files_pgn.size(); ++i) {
-    if (files_pgn[i].find(files_pgn[i - 1]) == 0) {
-      std::cout << "Error: \"Duplicate\" files: " << files_pgn[i - 1] << " and "
-                << files_pgn[i] << std::endl;
+  for (const auto &file : files_pgn) {
+    if (!duplicates.add(file))
       std::exit(1);
-    }
   }
 
   bool omit_move_counter = find_argument(args, pos, "--omitMoveCounter", true);
-  bool allow_duplicates = find_argument(args, pos, "--allowDuplicates", true);
   unsigned int tb_limit = 1;
   bool omit_mates = false;
   if (find_argument(args, pos, "--cdb", true)) {
@@ -607,22 +1480,28 @@ int main(int argc, char const *argv[]) {
     min_Elo = std::stoi(*std::next(pos));
   }
 
-  auto meta_map = get_metadata(files_pgn, allow_duplicates);
+  // the metadata cache is kept in the directory searched, or next to the file
+  std::string meta_cache_file;
+  if (find_argument(args, pos, "--cacheMeta", true)) {
+    const fs::path dir =
+        path.empty() ? fs::path(files_pgn[0]).parent_path() : fs::path(path);
+    meta_cache_file = (dir / ".fpmeta").string();
+  }
+
+  auto meta_map = get_metadata(files_pgn, concurrency, meta_cache_file);
 
-  if (find_argument(args, pos, "--SPRTonly", true)) {
+  if (sprt_only) {
     filter_files_sprt(files_pgn, meta_map);
   }
 
-  if (find_argument(args, pos, "--matchBook")) {
-    regex_book = *std::next(pos);
+  bool invert = find_argument(args, pos, "--matchBookInvert", true);
+  std::regex book_regex;
 
-    if (!regex_book.empty()) {
-      bool invert = find_argument(args, pos, "--matchBookInvert", true);
-      std::cout << "Filtering pgn files " << (invert ? "not " : "")
-                << "matching the book name " << regex_book << std::endl;
-      std::regex regex(regex_book);
-      filter_files_book(files_pgn, meta_map, regex, invert);
-    }
+  if (!regex_book.empty()) {
+    std::cout << "Filtering pgn files " << (invert ? "not " : "")
+              << "matching the book name " << regex_book << std::endl;
+    book_regex = std::regex(regex_book);
+    filter_files_book(files_pgn, meta_map, book_regex, invert);
   }
 
   if (find_argument(args, pos, "--maxPlies")) {
@@ -642,12 +1521,47 @@ int main(int argc, char const *argv[]) {
     min_count = std::stoi(*std::next(pos));
   }
 
-  bool fix_fens = find_argument(args, pos, "--fixFEN", true);
-
   if (find_argument(args, pos, "--matchEngine")) {
     regex_engine = *std::next(pos);
   }
 
+  bool cache_index = find_argument(args, pos, "--cacheIndex", true);
+
+  // files read ahead are held in memory, by each thread
+  static constexpr int max_prefetch = 64;
+  std::size_t prefetch = 2;
+  if (find_argument(args, pos, "--prefetch")) {
+    const int depth = std::stoi(*std::next(pos));
+
+    if (depth < 0) {
+      std::cout << "Error: --prefetch must not be negative" << std::endl;
+      std::exit(1);
+    }
+
+    prefetch = std::min(depth, max_prefetch);
+  }
+
+  std::size_t max_transitions = std::size_t(1) << 23;
+  if (find_argument(args, pos, "--maxTransitions")) {
+    const long long count = std::stoll(*std::next(pos));
+
+    if (count < 0) {
+      std::cout << "Error: --maxTransitions must not be negative" << std::endl;
+      std::exit(1);
+    }
+
+    max_transitions = static_cast<std::size_t>(count);
+  }
+
+  bool binary_output = find_argument(args, pos, "--binary", true);
+
+  int snapshot_interval = 0;
+  if (find_argument(args, pos, "--snapshot")) {
+    snapshot_interval = std::stoi(*std::next(pos));
+  } else if (watch) {
+    snapshot_interval = 60;
+  }
+
   if (find_argument(args, pos, "-o")) {
     filename = *std::next(pos);
   }
@@ -657,25 +1571,233 @@ int main(int argc, char const *argv[]) {
     return 1;
   }
 
-  std::ofstream out_file(filename);
+  OutputWriter out_file(filename);
+
+  if (!out_file.is_open()) {
+    std::cout << "Error: Cannot open output file " << filename << std::endl;
+    std::exit(1);
+  }
 
   const auto t0 = std::chrono::high_resolution_clock::now();
 
-  process(files_pgn, regex_engine, meta_map, fix_fens, max_plies,
-          count_stop_early, out_file, min_count, save_count, omit_move_counter,
-          tb_limit, omit_mates, min_Elo, concurrency);
+  analysis::Settings settings;
+  settings.regex_engine = regex_engine;
+  if (!regex_engine.empty())
+    settings.engine_regex = std::regex(regex_engine);
+  settings.fix_fens = fix_fens;
+  settings.max_plies = max_plies;
+  settings.count_stop_early = count_stop_early;
+  settings.min_count = min_count;
+  settings.save_count = save_count;
+  settings.omit_move_counter = omit_move_counter;
+  settings.tb_limit = tb_limit;
+  settings.omit_mates = omit_mates;
+  settings.min_Elo = min_Elo;
+  settings.prefetch = prefetch;
+  settings.max_transitions = max_transitions;
+  settings.binary_output = binary_output;
+
+  if (binary_output) {
+    std::string header;
+    BinaryRecord::append_header(header);
+    out_file.write(header);
+  }
+
+  // snapshots of the positions retained so far, with --saveCount the output
+  // file is replaced, otherwise the positions written are flushed to it
+  std::unique_ptr<PeriodicTask> snapshots;
+
+  if (snapshot_interval > 0) {
+    snapshots = std::make_unique<PeriodicTask>(
+        std::chrono::seconds(snapshot_interval), [&]() {
+          if (save_count)
+            write_snapshot(filename, binary_output);
+          else
+            out_file.flush();
+        });
+  }
+
+  if (stream_input) {
+    std::mutex progress_output;
+
+    // unless it was filtered out by the test metadata
+    if (!files_pgn.empty()) {
+      const std::string &file = files_pgn[0];
+      std::unique_ptr<std::istream> input;
+
+      if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz")
+        input = std::make_unique<GzFileStream>(file);
+#ifdef FASTPOPULAR_MMAP
+      else
+        input = std::make_unique<PipeStream>(file);
+#else
+      else if (file == "-")
+        input = std::make_unique<std::istream>(std::cin.rdbuf());
+      else
+        input = std::make_unique<std::ifstream>(file, std::ios::binary);
+#endif
+
+      if (!*input) {
+        std::cout << "Error: Cannot read " << file << std::endl;
+        std::exit(1);
+      }
+
+      std::cout << "Reading games from " << (file == "-" ? "stdin" : file)
+                << " with " << concurrency << " threads." << std::endl;
 
-  if (save_count) {
-    for (const auto &pair : fen_map) {
-      out_file << Board::Compact::decode(pair.second).getFen(false) << " ; c0 "
-               << zobrist_map[pair.first] << "\n";
+      analysis::ana_stream(*input, file, meta_map, settings, out_file,
+                           progress_output, concurrency);
     }
+  } else if (stream_files || watch) {
+    FileQueue files;
+
+    // a file may be found by the search and reported by the watcher, kept
+    // with its position in the queue and its size when queued
+    std::unordered_map<std::string, std::pair<std::size_t, std::uint64_t>>
+        queued;
+    std::mutex queued_mutex;
+
+    const auto queue_file = [&](std::string file, std::uint64_t size) {
+      const std::lock_guard<std::mutex> lock(queued_mutex);
+      if (duplicates.failed() || queued.find(file) != queued.end())
+        return;
+
+      // the files found so far are not analysed either, the analysis ends
+      // with an error
+      if (!duplicates.add(file)) {
+        std::size_t index;
+        while (files.try_next(index)) {
+        }
+        return;
+      }
+
+      queued[file] = {files.push(file, size), size};
+    };
+
+#ifdef FASTPOPULAR_INOTIFY
+    // a file closed by its writer after it was queued was found while still
+    // being written. It is updated if still waiting, and queued again
+    // otherwise, in which case the games read before are counted twice.
+    const auto queue_written = [&](std::string file, std::uint64_t size) {
+      {
+        const std::lock_guard<std::mutex> lock(queued_mutex);
+        const auto it = queued.find(file);
+
+        if (it != queued.end()) {
+          auto &[index, queued_size] = it->second;
+
+          if (size != queued_size && !files.resize(index, size))
+            index = files.push(file, size);
+
+          queued_size = size;
+          return;
+        }
+      }
+
+      queue_file(std::move(file), size);
+    };
+#endif
+
+    std::thread feeder([&]() {
+      if (stream_files) {
+        walk_files(path, recursive, concurrency, queue_file);
+      } else {
+        for (const auto &file : files_pgn)
+          queue_file(file, file_sizes[file]);
+      }
+
+#ifdef FASTPOPULAR_INOTIFY
+      if (watcher && !duplicates.failed()) {
+        std::signal(SIGINT, on_stop_signal);
+        std::signal(SIGTERM, on_stop_signal);
+
+        std::cout << "Watching " << path
+                  << " for new pgn files, interrupt to finish." << std::endl;
+
+        // new files pass the filters by the test metadata, files of tests
+        // without a .json file wait for it
+        std::vector<std::pair<std::string, std::uint64_t>> waiting;
+
+        const auto filter_file = [&](std::string file, std::uint64_t size) {
+          if (!sprt_only && regex_book.empty()) {
+            queue_written(std::move(file), size);
+            return;
+          }
+
+          const fs::path file_path(file);
+          const std::string filename = file_path.filename().string();
+          const std::string test_id =
+              filename.substr(0, filename.find_first_of("-."));
+          const std::string test_filename =
+              (file_path.parent_path() / test_id).string();
+
+          // the .json file may still be missing or incomplete
+          const auto test_meta = load_metadata(test_filename + ".json", false);
+
+          if (!test_meta.has_value()) {
+            waiting.emplace_back(std::move(file), size);
+            return;
+          }
+
+          const map_meta meta = {{test_filename, *test_meta}};
+          std::vector<std::string> list = {file};
+
+          if (sprt_only)
+            filter_files_sprt(list, meta);
+          if (!regex_book.empty())
+            filter_files_book(list, meta, book_regex, invert);
+          if (!list.empty())
+            queue_written(std::move(file), size);
+        };
+
+        while (!stop_watching && !duplicates.failed()) {
+          std::vector<std::pair<std::string, std::uint64_t>> retry;
+          retry.swap(waiting);
+
+          for (auto &[file, size] : retry)
+            filter_file(std::move(file), size);
+
+          watcher->poll(std::chrono::milliseconds(500), filter_file);
+        }
+      }
+#endif
+
+      files.close();
+    });
+
+    process(files, meta_map, settings, cache_index, out_file, concurrency,
+            io_threads, parse_threads);
+    feeder.join();
+  } else {
+    FileQueue files(files_pgn, file_sizes);
+    process(files, meta_map, settings, cache_index, out_file, concurrency,
+            io_threads, parse_threads);
+  }
+
+  if (snapshots)
+    snapshots->stop();
+
+  if (duplicates.failed()) {
+    out_file.close();
+    return 1;
+  }
+
+  bool written = true;
+
+  if (save_count && snapshot_interval > 0) {
+    // the output file has been replaced by the snapshots
+    written = write_snapshot(filename, binary_output);
+  } else if (save_count) {
+    write_counts(out_file, binary_output);
   } else {
     // TODO ? in principle one could read the file of written positions, compute
     // the hash, obtain the count from the zobrist_map and rewrite the file.
   }
 
-  out_file.close();
+  if (!out_file.close() || !written) {
+    std::cout << "\nError: Cannot write output file " << filename << std::endl;
+    return 1;
+  }
 
   const auto t1 = std::chrono::high_resolution_clock::now();
 
@@ -1,13 +1,45 @@
+#pragma once
+
 #include <zlib.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <istream>
+#include <limits>
+#include <mutex>
 #include <optional>
+#include <streambuf>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FASTPOPULAR_MMAP
+#define FASTPOPULAR_DIRENT
+#endif
+
 #include "external/json.hpp"
 
 enum class Result { WIN = 'W', DRAW = 'D', LOSS = 'L' };
@@ -23,29 +55,142 @@ struct TestMetaData {
   std::optional<int> book_depth;
 };
 
-template <typename T = std::string>
-std::optional<T> get_optional(const nlohmann::json &j, const char *name) {
-  const auto it = j.find(name);
-  if (it != j.end()) {
-    return std::optional<T>(j[name]);
-  } else {
-    return std::nullopt;
+/// @brief SAX handler extracting the TestMetaData of a test from its "args",
+/// without building the document. Parsing stops once "args" has been read.
+class TestMetaDataExtractor {
+public:
+  using json = nlohmann::json;
+
+  explicit TestMetaDataExtractor(TestMetaData &meta) : meta_(meta) {}
+
+  bool null() { return value(); }
+  bool boolean(bool) { return value(); }
+
+  bool number_integer(json::number_integer_t val) {
+    if (field_ == Field::BookDepth)
+      meta_.book_depth = static_cast<int>(val);
+    return value();
   }
-}
 
-void from_json(const nlohmann::json &nlohmann_json_j,
-               TestMetaData &nlohmann_json_t) {
-  auto &j = nlohmann_json_j["args"];
+  bool number_unsigned(json::number_unsigned_t val) {
+    if (field_ == Field::BookDepth)
+      meta_.book_depth = static_cast<int>(val);
+    return value();
+  }
 
-  nlohmann_json_t.book_depth =
-      get_optional(j, "book_depth").has_value()
-          ? std::optional<int>(std::stoi(get_optional(j, "book_depth").value()))
-          : std::nullopt;
+  bool number_float(json::number_float_t, const json::string_t &) {
+    return value();
+  }
 
-  nlohmann_json_t.sprt =
-      j.contains("sprt") ? std::optional<bool>(true) : std::nullopt;
+  bool string(json::string_t &val) {
+    if (field_ == Field::Book)
+      meta_.book = val;
+    else if (field_ == Field::BookDepth) {
+      // a value that is not a number leaves the depth unknown
+      int depth = 0;
+      const auto result =
+          std::from_chars(val.data(), val.data() + val.size(), depth);
+      if (result.ec == std::errc())
+        meta_.book_depth = depth;
+    }
+    return value();
+  }
+
+  bool binary(json::binary_t &) { return value(); }
+
+  bool start_object(std::size_t) { return start(); }
+  bool end_object() { return end(); }
+  bool start_array(std::size_t) { return start(); }
+  bool end_array() { return end(); }
+
+  bool key(json::string_t &val) {
+    field_ = Field::None;
+
+    if (depth_ == 1) {
+      args_key_ = val == "args";
+    } else if (depth_ == 2 && in_args_) {
+      if (val == "book")
+        field_ = Field::Book;
+      else if (val == "book_depth")
+        field_ = Field::BookDepth;
+      else if (val == "sprt")
+        // any value marks an SPRT test
+        meta_.sprt = true;
+    }
+
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &) {
+    failed_ = true;
+    return false;
+  }
+
+  /// @brief Check if the document was invalid, rather than parsing stopped
+  /// after "args"
+  [[nodiscard]] bool failed() const { return failed_; }
+
+private:
+  enum class Field { None, Book, BookDepth };
+
+  bool value() {
+    field_ = Field::None;
+    return true;
+  }
+
+  bool start() {
+    field_ = Field::None;
+    if (++depth_ == 2)
+      in_args_ = args_key_;
+    return true;
+  }
+
+  bool end() {
+    // nothing else is needed
+    if (depth_ == 2 && in_args_)
+      return false;
+
+    --depth_;
+    return value();
+  }
+
+  TestMetaData &meta_;
+  Field field_ = Field::None;
+  int depth_ = 0;
+  bool args_key_ = false;
+  bool in_args_ = false;
+  bool failed_ = false;
+};
+
+/// @brief Load the metadata of a test from its .json file.
+/// @param exit_on_error exit if the file is invalid, else treat it as missing,
+/// e.g. while it is still being written
+/// @return std::nullopt if there is no such file
+[[nodiscard]] inline std::optional<TestMetaData>
+load_metadata(const std::string &json_file, bool exit_on_error = true) {
+  std::ifstream in(json_file, std::ios::binary);
+
+  if (!in.is_open())
+    return std::nullopt;
+
+  const std::string data((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+
+  TestMetaData meta;
+  TestMetaDataExtractor extractor(meta);
+
+  nlohmann::json::sax_parse(data.begin(), data.end(), &extractor);
+
+  if (extractor.failed()) {
+    if (!exit_on_error)
+      return std::nullopt;
+
+    std::cout << "Error: Invalid metadata in " << json_file << std::endl;
+    std::exit(1);
+  }
 
-  nlohmann_json_t.book = get_optional(j, "book");
+  return meta;
 }
 
 /// @brief Custom stof implementation to avoid locale issues, once clang
@@ -92,57 +237,990 @@ inline float fast_stof(const char *str) {
   return result;
 }
 
+/// @brief Integer at the start of a string, like std::stoi but without
+/// allocation or exceptions
+/// @return 0 if there is no integer or it is out of range
+inline int parse_int(std::string_view str) {
+  while (!str.empty() && std::isspace(static_cast<unsigned char>(str[0])))
+    str.remove_prefix(1);
+
+  if (str.size() >= 2 && str[0] == '+' && str[1] >= '0' && str[1] <= '9')
+    str.remove_prefix(1);
+
+  int value = 0;
+  const auto result =
+      std::from_chars(str.data(), str.data() + str.size(), value);
+
+  return result.ec == std::errc() ? value : 0;
+}
+
+/// @brief Copy of a short string in storage of fixed capacity, so that it can
+/// be reassigned without allocation. Longer strings, which are not expected,
+/// are kept on the heap.
+template <std::size_t Capacity> class FixedString {
+public:
+  void assign(std::string_view str) {
+    is_long_ = str.size() > Capacity;
+
+    if (is_long_) {
+      long_.assign(str);
+    } else {
+      std::memcpy(data_, str.data(), str.size());
+      size_ = str.size();
+    }
+  }
+
+  void clear() {
+    size_ = 0;
+    is_long_ = false;
+  }
+
+  [[nodiscard]] bool empty() const { return view().empty(); }
+
+  [[nodiscard]] std::string_view view() const {
+    return is_long_ ? std::string_view(long_) : std::string_view(data_, size_);
+  }
+
+private:
+  char data_[Capacity];
+  std::size_t size_ = 0;
+  bool is_long_ = false;
+  std::string long_;
+};
+
+/// @brief Stream buffer for inflated data. Large reads, such as the refills of
+/// the pgn parser, are inflated by zlib directly into the destination buffer,
+/// only peek() goes through the small internal get area.
+class InflateBuf : public std::streambuf {
+protected:
+  /// @brief Inflate up to len bytes into dst
+  /// @return the number of bytes, 0 at the end of the data, -1 on errors
+  virtual int read(char *dst, unsigned len) = 0;
+
+  int_type underflow() override {
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+
+    const int n = read(get_area_, sizeof(get_area_));
+    if (n <= 0)
+      return traits_type::eof();
+
+    setg(get_area_, get_area_, get_area_ + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  std::streamsize xsgetn(char *s, std::streamsize n) override {
+    std::streamsize copied = std::min<std::streamsize>(egptr() - gptr(), n);
+
+    if (copied > 0) {
+      std::memcpy(s, gptr(), copied);
+      gbump(static_cast<int>(copied));
+    }
+
+    while (copied < n) {
+      const auto len = std::min<std::streamsize>(n - copied, INT_MAX);
+      const int r = read(s + copied, static_cast<unsigned>(len));
+      if (r <= 0)
+        break;
+      copied += r;
+    }
+
+    return copied;
+  }
+
+private:
+  char get_area_[4096];
+};
+
+/// @brief Stream buffer for .gz files, see InflateBuf.
+class GzFileBuf : public InflateBuf {
+public:
+  explicit GzFileBuf(const std::string &path) {
+    file_ = gzopen(path.c_str(), "rb");
+    if (file_ != nullptr)
+      gzbuffer(file_, input_size);
+  }
+
+  GzFileBuf(const GzFileBuf &) = delete;
+  GzFileBuf &operator=(const GzFileBuf &) = delete;
+
+  ~GzFileBuf() override {
+    if (file_ != nullptr)
+      gzclose(file_);
+  }
+
+  [[nodiscard]] bool is_open() const { return file_ != nullptr; }
+
+protected:
+  int read(char *dst, unsigned len) override {
+    return file_ == nullptr ? -1 : gzread(file_, dst, len);
+  }
+
+private:
+  /// @brief Size of zlib's compressed input buffer
+  static constexpr unsigned input_size = 1 << 18;
+
+  gzFile file_ = nullptr;
+};
+
+/// @brief Stream buffer for gzip data in memory, e.g. a prefetched .gz file,
+/// see InflateBuf. Concatenated gzip members are inflated one after another.
+class GzMemoryBuf : public InflateBuf {
+public:
+  GzMemoryBuf(const char *data, std::size_t size)
+      : next_(reinterpret_cast<const unsigned char *>(data)), left_(size) {
+    ok_ = inflateInit2(&strm_, 31) == Z_OK;
+  }
+
+  GzMemoryBuf(const GzMemoryBuf &) = delete;
+  GzMemoryBuf &operator=(const GzMemoryBuf &) = delete;
+
+  ~GzMemoryBuf() override {
+    if (ok_)
+      inflateEnd(&strm_);
+  }
+
+protected:
+  int read(char *dst, unsigned len) override {
+    if (!ok_)
+      return -1;
+
+    strm_.next_out = reinterpret_cast<unsigned char *>(dst);
+    strm_.avail_out = len;
+
+    while (strm_.avail_out > 0) {
+      if (strm_.avail_in == 0) {
+        if (left_ == 0)
+          break;
+
+        // zlib takes at most UINT_MAX bytes of input at once
+        strm_.next_in = const_cast<unsigned char *>(next_);
+        strm_.avail_in =
+            static_cast<unsigned>(std::min<std::size_t>(left_, UINT_MAX));
+        next_ += strm_.avail_in;
+        left_ -= strm_.avail_in;
+      }
+
+      const int ret = inflate(&strm_, Z_NO_FLUSH);
+
+      if (ret == Z_STREAM_END) {
+        if (strm_.avail_in == 0 && left_ == 0)
+          break;
+
+        // another gzip member follows
+        inflateReset(&strm_);
+      } else if (ret != Z_OK) {
+        ok_ = false;
+        break;
+      }
+    }
+
+    return static_cast<int>(len - strm_.avail_out);
+  }
+
+private:
+  z_stream strm_{};
+  const unsigned char *next_;
+  std::size_t left_;
+  bool ok_;
+};
+
+/// @brief Input stream over a .gz file, see GzFileBuf.
+class GzFileStream : public std::istream {
+public:
+  explicit GzFileStream(const std::string &path)
+      : std::istream(nullptr), buf_(path) {
+    rdbuf(&buf_);
+    if (!buf_.is_open())
+      setstate(std::ios::badbit);
+  }
+
+private:
+  GzFileBuf buf_;
+};
+
+/// @brief Input stream over gzip data in memory, see GzMemoryBuf.
+class GzMemoryStream : public std::istream {
+public:
+  GzMemoryStream(const char *data, std::size_t size)
+      : std::istream(nullptr), buf_(data, size) {
+    rdbuf(&buf_);
+  }
+
+private:
+  GzMemoryBuf buf_;
+};
+
+#ifdef FASTPOPULAR_MMAP
+
+/// @brief Stream buffer of a pipe, i.e. stdin or a named pipe. Unlike a file
+/// buffer it hands out the data as soon as it arrives, rather than waiting
+/// until a read can be filled.
+class PipeBuf : public std::streambuf {
+public:
+  /// @param path "-" for stdin
+  explicit PipeBuf(const std::string &path)
+      : fd_(path == "-" ? 0 : ::open(path.c_str(), O_RDONLY)),
+        owned_(path != "-") {}
+
+  PipeBuf(const PipeBuf &) = delete;
+  PipeBuf &operator=(const PipeBuf &) = delete;
+
+  ~PipeBuf() override {
+    if (owned_ && fd_ >= 0)
+      ::close(fd_);
+  }
+
+  [[nodiscard]] bool is_open() const { return fd_ >= 0; }
+
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+
+    const std::streamsize n = read(get_area_, sizeof(get_area_));
+    if (n <= 0)
+      return traits_type::eof();
+
+    setg(get_area_, get_area_, get_area_ + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  std::streamsize xsgetn(char *s, std::streamsize n) override {
+    const std::streamsize buffered =
+        std::min<std::streamsize>(egptr() - gptr(), n);
+
+    if (buffered > 0) {
+      std::memcpy(s, gptr(), buffered);
+      gbump(static_cast<int>(buffered));
+      return buffered;
+    }
+
+    return std::max<std::streamsize>(read(s, n), 0);
+  }
+
+private:
+  std::streamsize read(char *dst, std::streamsize len) {
+    if (fd_ < 0)
+      return -1;
+
+    ssize_t n;
+
+    do {
+      n = ::read(fd_, dst, static_cast<std::size_t>(len));
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+  }
+
+  const int fd_;
+  const bool owned_;
+  char get_area_[4096];
+};
+
+/// @brief Input stream of a pipe, see PipeBuf.
+class PipeStream : public std::istream {
+public:
+  explicit PipeStream(const std::string &path)
+      : std::istream(nullptr), buf_(path) {
+    rdbuf(&buf_);
+    if (!buf_.is_open())
+      setstate(std::ios::badbit);
+  }
+
+private:
+  PipeBuf buf_;
+};
+
+#endif
+
+/// @brief Check if p points to the '[' of the first tag of a game, i.e. a tag
+/// following an empty line. Requires three readable bytes before p.
+inline bool is_game_start(const char *p) {
+  return p[0] == '[' && p[-1] == '\n' &&
+         (p[-2] == '\n' || (p[-2] == '\r' && p[-3] == '\n'));
+}
+
+/// @brief Offset of the first game of the byte range starting at offset in a
+/// block of pgn data, see GameRangeBuf for the ownership of games.
+inline std::size_t find_game_start(std::string_view data, std::size_t offset) {
+  if (offset == 0)
+    return 0;
+
+  std::size_t pos = offset + 3;
+
+  while (pos < data.size()) {
+    pos = data.find('[', pos);
+
+    if (pos == std::string_view::npos)
+      break;
+
+    if (is_game_start(data.data() + pos))
+      return pos;
+
+    ++pos;
+  }
+
+  return data.size();
+}
+
+/// @brief Offset of the last game start in a block of pgn data, 0 if there is
+/// none after the beginning.
+inline std::size_t find_last_game_start(const char *data, std::size_t len) {
+  for (std::size_t i = len; i-- > 3;) {
+    if (data[i] == '[' && is_game_start(data + i))
+      return i;
+  }
+
+  return 0;
+}
+
+/// @brief Stream buffer over the games of a byte range of pgn data, used to
+/// analyze parts of a single file in parallel. Source::read(dst, n) produces
+/// the data sequentially, starting at offset begin. The range owns the games
+/// whose first tag is at an offset in [begin + 3, end + 3), or [0, end + 3)
+/// for begin == 0. Ranges sharing a boundary thus partition the games, and the
+/// data is read past end up to the first game of the next range.
+template <typename Source> class GameRangeBuf : public std::streambuf {
+public:
+  static constexpr std::uint64_t npos =
+      std::numeric_limits<std::uint64_t>::max();
+
+  template <typename... Args>
+  GameRangeBuf(std::uint64_t begin, std::uint64_t end, Args &&...args)
+      : source_(std::forward<Args>(args)...), buffer_(buffer_size),
+        offset_(begin), first_(begin + lookbehind),
+        last_(end == npos ? npos : end + lookbehind), started_(begin == 0) {}
+
+  GameRangeBuf(const GameRangeBuf &) = delete;
+  GameRangeBuf &operator=(const GameRangeBuf &) = delete;
+
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+
+    while (!done_) {
+      // keep the last bytes to recognise a game start at the buffer boundary
+      const std::size_t keep = std::min(len_, lookbehind);
+      std::memmove(buffer_.data(), buffer_.data() + len_ - keep, keep);
+      offset_ += len_ - keep;
+      len_ = keep;
+
+      const std::size_t n =
+          source_.read(buffer_.data() + len_, buffer_.size() - len_);
+
+      if (n == 0) {
+        done_ = true;
+        break;
+      }
+
+      std::size_t from = len_;
+      len_ += n;
+
+      if (!started_) {
+        from = find_game_start(std::max(from, index_of(first_)));
+
+        if (from == len_)
+          continue;
+
+        started_ = true;
+      }
+
+      std::size_t to = find_game_start(std::max(from, index_of(last_)));
+      done_ = to < len_;
+
+      if (from < to) {
+        setg(buffer_.data() + from, buffer_.data() + from,
+             buffer_.data() + to);
+        return traits_type::to_int_type(*gptr());
+      }
+    }
+
+    return traits_type::eof();
+  }
+
+private:
+  /// @brief Index in the buffer of the given offset, clamped to the buffer
+  std::size_t index_of(std::uint64_t offset) const {
+    if (offset < offset_)
+      return 0;
+    return std::min<std::uint64_t>(offset - offset_, len_);
+  }
+
+  /// @brief Index of the first game start in [from, len_), or len_
+  std::size_t find_game_start(std::size_t from) const {
+    const char *data = buffer_.data();
+    const char *p = data + std::max(from, lookbehind);
+    const char *end = data + len_;
+
+    while (p < end) {
+      p = static_cast<const char *>(std::memchr(p, '[', end - p));
+
+      if (p == nullptr)
+        break;
+
+      if (is_game_start(p))
+        return p - data;
+
+      ++p;
+    }
+
+    return len_;
+  }
+
+  static constexpr std::size_t buffer_size = std::size_t(1) << 20;
+  static constexpr std::size_t lookbehind = 3;
+
+  Source source_;
+  std::vector<char> buffer_;
+  std::size_t len_ = 0;
+  std::uint64_t offset_;
+  const std::uint64_t first_;
+  const std::uint64_t last_;
+  bool started_;
+  bool done_ = false;
+};
+
+/// @brief Read-only memory mapping of a whole file. The pages are read ahead
+/// sequentially, or faulted in up front with populate, where the platform
+/// supports it. Without mmap the file is read into memory instead.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path, bool populate = true) {
+#ifdef FASTPOPULAR_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+      return;
+
+    struct stat st;
+
+    if (::fstat(fd, &st) == 0) {
+      size_ = st.st_size;
+      open_ = true;
+
+      if (size_ > 0) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (populate)
+          flags |= MAP_POPULATE;
+#endif
+        void *addr = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+
+        if (addr == MAP_FAILED) {
+          size_ = 0;
+          open_ = false;
+        } else {
+          data_ = static_cast<const char *>(addr);
+          ::madvise(addr, size_, MADV_SEQUENTIAL);
+        }
+      }
+    }
+
+    ::close(fd);
+#else
+    (void)populate;
+    std::ifstream in(path, std::ios::binary);
+
+    if (!in.is_open())
+      return;
+
+    contents_.assign(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+    data_ = contents_.data();
+    size_ = contents_.size();
+    open_ = true;
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+#ifdef FASTPOPULAR_MMAP
+    if (data_ != nullptr)
+      ::munmap(const_cast<char *>(data_), size_);
+#endif
+  }
+
+  [[nodiscard]] bool is_open() const { return open_; }
+  [[nodiscard]] const char *data() const { return data_; }
+  [[nodiscard]] std::size_t size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+  bool open_ = false;
+#ifndef FASTPOPULAR_MMAP
+  std::vector<char> contents_;
+#endif
+};
+
+/// @brief Queue of fixed capacity between producer and consumer threads
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(std::size_t capacity) : capacity_(capacity) {}
+
+  /// @brief Add an item, waits while the queue is full
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+    items_.push_back(std::move(item));
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+  /// @brief Take the oldest item, waits while the queue is empty
+  /// @return false once the queue is closed and empty
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+
+    if (items_.empty())
+      return false;
+
+    item = std::move(items_.front());
+    items_.pop_front();
+    lock.unlock();
+    not_full_.notify_one();
+
+    return true;
+  }
+
+  /// @brief No more items will be pushed
+  void close() {
+    {
+      const std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+  }
+
+private:
+  const std::size_t capacity_;
+  std::deque<T> items_;
+  bool closed_ = false;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+/// @brief Check for the name of a .pgn or .pgn.gz file
+[[nodiscard]] inline bool is_pgn_name(std::string_view name) {
+  const auto ends_with = [name](std::string_view suffix) {
+    return name.size() > suffix.size() &&
+           name.substr(name.size() - suffix.size()) == suffix;
+  };
+
+  return ends_with(".pgn") || ends_with(".pgn.gz");
+}
+
+#ifdef FASTPOPULAR_DIRENT
+
+/// @brief List a directory, telling entries apart by the d_type of readdir.
+/// A stat is only done for the size of the files found, or where the
+/// filesystem does not report the type.
+template <typename OnFile>
+void list_directory(const std::string &dir, bool recursive,
+                    std::vector<std::string> &subdirs, OnFile &on_file) {
+  DIR *stream = ::opendir(dir.c_str());
+
+  // runs on the threads of the search, a directory that cannot be read is
+  // left out rather than ending the analysis under way
+  if (stream == nullptr) {
+    std::cerr << "Error: Cannot read directory " << dir << ", skipping it"
+              << std::endl;
+    return;
+  }
+
+  const int fd = ::dirfd(stream);
+  const std::string prefix = dir.back() == '/' ? dir : dir + '/';
+
+  while (const dirent *entry = ::readdir(stream)) {
+    const std::string_view name = entry->d_name;
+
+    if (name == "." || name == "..")
+      continue;
+
+    unsigned char type = entry->d_type;
+    struct stat st;
+    bool have_stat = false;
+
+    // follow symbolic links like std::filesystem::is_directory does
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      if (::fstatat(fd, entry->d_name, &st, 0) != 0)
+        continue;
+
+      have_stat = true;
+      type = S_ISDIR(st.st_mode)   ? DT_DIR
+             : S_ISREG(st.st_mode) ? DT_REG
+                                   : DT_UNKNOWN;
+    }
+
+    if (type == DT_DIR) {
+      if (recursive)
+        subdirs.push_back(prefix + entry->d_name);
+    } else if (type == DT_REG && is_pgn_name(name)) {
+      if (!have_stat && ::fstatat(fd, entry->d_name, &st, 0) != 0)
+        continue;
+
+      on_file(prefix + entry->d_name, std::uint64_t(st.st_size));
+    }
+  }
+
+  ::closedir(stream);
+}
+
+#endif
+
+/// @brief Find the .pgn(.gz) files of a directory. Several threads list the
+/// directories of the tree, one directory at a time each.
+/// @param on_file called by the walking threads with the path and size of
+/// each file as soon as it is found
+template <typename OnFile>
+void walk_files(const std::string &path, bool recursive, int threads,
+                OnFile &&on_file) {
+#ifdef FASTPOPULAR_DIRENT
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> dirs{path};
+  // directories being listed, which may add more
+  int busy = 0;
+
+  const auto walk = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+      cv.wait(lock, [&] { return !dirs.empty() || busy == 0; });
+
+      if (dirs.empty())
+        return;
+
+      const std::string dir = std::move(dirs.back());
+      dirs.pop_back();
+      ++busy;
+      lock.unlock();
+
+      std::vector<std::string> subdirs;
+      list_directory(dir, recursive, subdirs, on_file);
+
+      lock.lock();
+      --busy;
+      for (auto &subdir : subdirs)
+        dirs.push_back(std::move(subdir));
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; ++i)
+    workers.emplace_back(walk);
+
+  walk();
+
+  for (auto &worker : workers)
+    worker.join();
+#else
+  (void)threads;
+
+  const auto visit = [&](const std::filesystem::directory_entry &entry) {
+    if (entry.is_regular_file() &&
+        is_pgn_name(entry.path().filename().string()))
+      on_file(entry.path().string(), std::uint64_t(entry.file_size()));
+  };
+
+  if (recursive) {
+    for (const auto &entry :
+         std::filesystem::recursive_directory_iterator(path))
+      visit(entry);
+  } else {
+    for (const auto &entry : std::filesystem::directory_iterator(path))
+      visit(entry);
+  }
+#endif
+}
+
 /// @brief Get all files from a directory.
 /// @param path
 /// @param recursive
+/// @param threads number of threads walking the directory tree
+/// @param sizes if given, filled with the sizes of the files in bytes
 /// @return
 [[nodiscard]] inline std::vector<std::string>
-get_files(const std::string &path, bool recursive = false) {
+get_files(const std::string &path, bool recursive = false, int threads = 1,
+          std::unordered_map<std::string, std::uint64_t> *sizes = nullptr) {
   std::vector<std::string> files;
+  std::mutex mutex;
 
-  for (const auto &entry : std::filesystem::directory_iterator(path)) {
-    if (std::filesystem::is_regular_file(entry)) {
-      std::string stem = entry.path().stem().string();
-      std::string extension = entry.path().extension().string();
-      if (extension == ".gz") {
-        if (stem.size() >= 4 && stem.substr(stem.size() - 4) == ".pgn") {
-          files.push_back(entry.path().string());
-        }
-      } else if (extension == ".pgn") {
-        files.push_back(entry.path().string());
+  walk_files(path, recursive, threads,
+             [&](std::string file, std::uint64_t size) {
+               const std::lock_guard<std::mutex> lock(mutex);
+               if (sizes != nullptr)
+                 (*sizes)[file] = size;
+               files.push_back(std::move(file));
+             });
+
+  return files;
+}
+
+/// @brief Files shared by the threads of an analysis. Threads take the next
+/// file whenever they are done with their previous one, so that no thread
+/// idles while files are left. Files are handed out largest first, so the run
+/// does not end with a single large file being analyzed alone. Files can be
+/// pushed while the threads take them, until the queue is closed.
+class FileQueue {
+public:
+  /// @brief Open queue, to be filled with push() and close()
+  FileQueue() = default;
+
+  /// @brief Closed queue of the given files
+  /// @param sizes known sizes of the files, others are looked up
+  explicit FileQueue(
+      const std::vector<std::string> &files,
+      const std::unordered_map<std::string, std::uint64_t> &sizes = {}) {
+    for (const auto &file : files) {
+      if (const auto it = sizes.find(file); it != sizes.end()) {
+        push(file, it->second);
+        continue;
       }
-    } else if (recursive && std::filesystem::is_directory(entry)) {
-      auto subdir_files = get_files(entry.path().string(), true);
-      files.insert(files.end(), subdir_files.begin(), subdir_files.end());
+
+      std::error_code ec;
+      const std::uint64_t size = std::filesystem::file_size(file, ec);
+      push(file, ec ? 0 : size);
     }
+
+    close();
   }
 
-  return files;
-}
+  FileQueue(const FileQueue &) = delete;
+  FileQueue &operator=(const FileQueue &) = delete;
 
-/// @brief Split into successive n-sized chunks from pgns.
-/// @param pgns
-/// @param target_chunks
-/// @return
-[[nodiscard]] inline std::vector<std::vector<std::string>>
-split_chunks(const std::vector<std::string> &pgns, int target_chunks) {
-  const int chunks_size = (pgns.size() + target_chunks - 1) / target_chunks;
+  /// @return the position of the file in the queue
+  std::size_t push(std::string file, std::uint64_t size) {
+    std::size_t index;
+
+    {
+      const std::lock_guard<std::mutex> lock(mutex_);
 
-  auto begin = pgns.begin();
-  auto end = pgns.end();
+      files_.push_back(std::move(file));
+      sizes_.push_back(size);
+      total_size_ += size;
 
-  std::vector<std::vector<std::string>> chunks;
+      index = files_.size() - 1;
+      heap_.push_back(index);
+      std::push_heap(heap_.begin(), heap_.end(), smaller_);
+    }
 
-  while (begin != end) {
-    auto next =
-        std::next(begin, std::min(chunks_size,
-                                  static_cast<int>(std::distance(begin, end))));
-    chunks.push_back(std::vector<std::string>(begin, next));
-    begin = next;
+    not_empty_.notify_one();
+    return index;
   }
 
-  return chunks;
-}
+  /// @brief Update the size of a file that has not been taken yet
+  /// @return false if the file has been taken already
+  bool resize(std::size_t index, std::uint64_t size) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+
+    if (std::find(heap_.begin(), heap_.end(), index) == heap_.end())
+      return false;
+
+    total_size_ += size - sizes_[index];
+    sizes_[index] = size;
+    std::make_heap(heap_.begin(), heap_.end(), smaller_);
+
+    return true;
+  }
+
+  /// @brief No more files will be pushed
+  void close() {
+    {
+      const std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+
+    not_empty_.notify_all();
+  }
+
+  /// @brief Take the largest file queued, waits while the queue is empty but
+  /// still open.
+  /// @param index set to the position of the file in the queue
+  /// @return false if all files have been taken
+  bool next(std::size_t &index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !heap_.empty() || closed_; });
+
+    if (heap_.empty())
+      return false;
+
+    std::pop_heap(heap_.begin(), heap_.end(), smaller_);
+    index = heap_.back();
+    heap_.pop_back();
+
+    return true;
+  }
+
+  /// @brief Take the largest file queued, without waiting
+  /// @param max_size the file is only taken if it is not larger
+  /// @return false if no file is queued at the moment, or it is too large
+  bool try_next(
+      std::size_t &index,
+      std::uint64_t max_size = std::numeric_limits<std::uint64_t>::max()) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+
+    if (heap_.empty() || sizes_[heap_.front()] > max_size)
+      return false;
+
+    std::pop_heap(heap_.begin(), heap_.end(), smaller_);
+    index = heap_.back();
+    heap_.pop_back();
+
+    return true;
+  }
+
+  /// @brief Path of a file, the reference stays valid while files are pushed
+  [[nodiscard]] const std::string &operator[](std::size_t index) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return files_[index];
+  }
+
+  /// @brief Size of a file on disk in bytes
+  [[nodiscard]] std::uint64_t file_size(std::size_t index) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return sizes_[index];
+  }
+
+  /// @brief Size of the files pushed so far
+  [[nodiscard]] std::uint64_t total_size() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return total_size_;
+  }
+
+  /// @brief Number of files pushed so far
+  [[nodiscard]] std::size_t size() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return files_.size();
+  }
+
+  [[nodiscard]] bool closed() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+  }
+
+private:
+  // orders the heap by size, and files of equal size in order of the push
+  struct Smaller {
+    const std::deque<std::uint64_t> &sizes;
+
+    bool operator()(std::size_t a, std::size_t b) const {
+      return sizes[a] != sizes[b] ? sizes[a] < sizes[b] : a > b;
+    }
+  };
+
+  std::deque<std::string> files_;
+  std::deque<std::uint64_t> sizes_;
+  std::uint64_t total_size_ = 0;
+  std::vector<std::size_t> heap_;
+  const Smaller smaller_{sizes_};
+  bool closed_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+};
+
+/// @brief Progress of an analysis by the bytes of the files done, with an
+/// estimate of the remaining time once all files are known.
+class Progress {
+public:
+  explicit Progress(FileQueue &files)
+      : files_(files), start_(std::chrono::steady_clock::now()) {}
+
+  /// @brief Count a finished file and print the progress.
+  void file_done(std::uint64_t bytes, std::mutex &progress_output) {
+    const std::size_t count = ++count_;
+    const std::uint64_t done = done_bytes_ += bytes;
+
+    // files may still be found while the analysis runs
+    const bool all_known = files_.closed();
+    const std::uint64_t total_bytes = files_.total_size();
+
+    const double elapsed = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start_)
+                               .count();
+    const double fraction =
+        total_bytes > 0 ? double(done) / double(total_bytes) : 1.0;
+
+    // formatted apart, so that the format of std::cout is left alone
+    std::ostringstream line;
+    line << "\rProcessed " << count << " files, " << std::fixed
+         << std::setprecision(1) << done / 1e6;
+
+    if (!all_known) {
+      line << " MB, still searching for files";
+    } else {
+      line << " of " << total_bytes / 1e6 << " MB (" << 100 * fraction << "%)";
+
+      if (done > 0 && fraction < 1.0)
+        line << ", ETA " << std::setprecision(0)
+             << elapsed * (1.0 - fraction) / fraction << " s";
+    }
+
+    line << "     ";
+
+    const std::lock_guard<std::mutex> lock(progress_output);
+    std::cout << line.str() << std::flush;
+  }
+
+private:
+  FileQueue &files_;
+  const std::chrono::steady_clock::time_point start_;
+  std::atomic<std::size_t> count_ = 0;
+  std::atomic<std::uint64_t> done_bytes_ = 0;
+};
+
+/// @brief Runs a task at a fixed interval on a thread of its own, until it is
+/// stopped.
+class PeriodicTask {
+public:
+  PeriodicTask(std::chrono::milliseconds interval, std::function<void()> task)
+      : interval_(interval), task_(std::move(task)),
+        thread_([this]() { run(); }) {}
+
+  PeriodicTask(const PeriodicTask &) = delete;
+  PeriodicTask &operator=(const PeriodicTask &) = delete;
+
+  ~PeriodicTask() { stop(); }
+
+  /// @brief Stop, waits for a run of the task in progress.
+  void stop() {
+    {
+      const std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+
+    cv_.notify_all();
+
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (!cv_.wait_for(lock, interval_, [this] { return stopped_; })) {
+      lock.unlock();
+      task_();
+      lock.lock();
+    }
+  }
+
+  const std::chrono::milliseconds interval_;
+  const std::function<void()> task_;
+  bool stopped_ = false;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
 
 inline bool find_argument(const std::vector<std::string> &args,
                           std::vector<std::string>::const_iterator &pos,
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fastpopular.hpp"
+
+/// @brief Access point of a gzip file, from which inflation can start without
+/// reading the data before it, following zlib's examples/zran.c.
+struct GzAccessPoint {
+  /// @brief Offset in the uncompressed data
+  std::uint64_t out = 0;
+  /// @brief Offset in the compressed file of the first complete byte
+  std::uint64_t in = 0;
+  /// @brief Number of bits of the previous byte that belong to the block
+  int bits = 0;
+  /// @brief Uncompressed data preceding the access point
+  std::vector<unsigned char> window;
+};
+
+/// @brief Index of access points of a gzip file
+class GzIndex {
+public:
+  /// @brief Maximal distance of a deflate back-reference
+  static constexpr std::size_t window_size = 32768;
+
+  std::vector<GzAccessPoint> points;
+
+  /// @brief Inflate the whole file, adding an access point at the first block
+  /// boundary after every span bytes of uncompressed data.
+  /// @param file
+  /// @param span
+  /// @param on_point called after each new access point
+  /// @return false if the file could not be read or is corrupt
+  bool build(const std::string &file, std::uint64_t span,
+             const std::function<void(const GzIndex &)> &on_point = {}) {
+    points.clear();
+
+    std::ifstream in(file, std::ios::binary);
+    z_stream strm{};
+
+    if (!in.is_open() || inflateInit2(&strm, 31) != Z_OK)
+      return false;
+
+    std::vector<unsigned char> input(1 << 16);
+    std::vector<unsigned char> window(window_size);
+    std::uint64_t total_in = 0, total_out = 0, last = 0;
+    bool ok = false;
+
+    while (true) {
+      if (strm.avail_in == 0) {
+        in.read(reinterpret_cast<char *>(input.data()), input.size());
+        strm.avail_in = static_cast<unsigned>(in.gcount());
+        strm.next_in = input.data();
+
+        // truncated file
+        if (strm.avail_in == 0)
+          break;
+      }
+
+      if (strm.avail_out == 0) {
+        strm.avail_out = window_size;
+        strm.next_out = window.data();
+      }
+
+      total_in += strm.avail_in;
+      total_out += strm.avail_out;
+      int ret = inflate(&strm, Z_BLOCK);
+      total_in -= strm.avail_in;
+      total_out -= strm.avail_out;
+
+      if (ret == Z_STREAM_END) {
+        // another gzip member may follow
+        if (strm.avail_in == 0 && in.peek() == EOF) {
+          ok = true;
+          break;
+        }
+
+        ret = inflateReset2(&strm, 31);
+      }
+
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        break;
+
+      // at the end of a header or a block, but not of the last block
+      if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+          (points.empty() || total_out - last > span)) {
+        add_point(strm.data_type & 7, total_in, total_out, window,
+                  strm.avail_out);
+        last = total_out;
+
+        if (on_point)
+          on_point(*this);
+      }
+    }
+
+    inflateEnd(&strm);
+
+    return ok;
+  }
+
+  /// @brief Write the index, stamped with the size and modification time of
+  /// the indexed file.
+  bool save(const std::string &index_file, const std::string &file) const {
+    std::ofstream out(index_file, std::ios::binary);
+
+    if (!out.is_open())
+      return false;
+
+    out.write(magic, sizeof(magic));
+    write(out, std::uint64_t(std::filesystem::file_size(file)));
+    write(out, stamp(file));
+    write(out, std::uint64_t(points.size()));
+
+    for (const auto &point : points) {
+      write(out, point.out);
+      write(out, point.in);
+      write(out, std::int32_t(point.bits));
+      out.write(reinterpret_cast<const char *>(point.window.data()),
+                window_size);
+    }
+
+    return bool(out);
+  }
+
+  /// @brief Read an index written by save(), fails if the indexed file
+  /// changed in the meantime.
+  bool load(const std::string &index_file, const std::string &file) {
+    points.clear();
+
+    std::ifstream in(index_file, std::ios::binary);
+
+    if (!in.is_open())
+      return false;
+
+    char header[sizeof(magic)] = {};
+    std::uint64_t size = 0, count = 0;
+    std::int64_t time = 0;
+
+    in.read(header, sizeof(header));
+    read(in, size);
+    read(in, time);
+    read(in, count);
+
+    if (!in || !std::equal(header, header + sizeof(header), magic) ||
+        size != std::filesystem::file_size(file) || time != stamp(file))
+      return false;
+
+    for (std::uint64_t i = 0; i < count && in; ++i) {
+      GzAccessPoint point;
+      std::int32_t bits = 0;
+
+      read(in, point.out);
+      read(in, point.in);
+      read(in, bits);
+      point.bits = bits;
+      point.window.resize(window_size);
+      in.read(reinterpret_cast<char *>(point.window.data()), window_size);
+
+      points.push_back(std::move(point));
+    }
+
+    if (!in) {
+      points.clear();
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  void add_point(int bits, std::uint64_t in, std::uint64_t out,
+                 const std::vector<unsigned char> &window, unsigned left) {
+    GzAccessPoint point;
+    point.bits = bits;
+    point.in = in;
+    point.out = out;
+    point.window.resize(window_size);
+
+    // the circular window ends at the current output position
+    std::copy(window.begin() + (window_size - left), window.end(),
+              point.window.begin());
+    std::copy(window.begin(), window.begin() + (window_size - left),
+              point.window.begin() + left);
+
+    points.push_back(std::move(point));
+  }
+
+  static std::int64_t stamp(const std::string &file) {
+    return std::filesystem::last_write_time(file).time_since_epoch().count();
+  }
+
+  template <typename T> static void write(std::ofstream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T> static void read(std::ifstream &in, T &value) {
+    in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  }
+
+  static constexpr char magic[8] = {'F', 'P', 'G', 'Z', 'I', 'D', 'X', '1'};
+};
+
+/// @brief Sequential reader of the uncompressed data of a gzip file, starting
+/// at an access point.
+class GzPointSource {
+public:
+  GzPointSource(const std::string &file, const GzAccessPoint &point)
+      : in_(file, std::ios::binary), input_(1 << 16) {
+    if (!in_.is_open() || inflateInit2(&strm_, -15) != Z_OK) {
+      done_ = true;
+      return;
+    }
+
+    initialized_ = true;
+
+    in_.seekg(point.in - (point.bits ? 1 : 0));
+
+    if (point.bits) {
+      const int c = in_.get();
+      inflatePrime(&strm_, point.bits, c >> (8 - point.bits));
+    }
+
+    inflateSetDictionary(&strm_, point.window.data(), GzIndex::window_size);
+
+    done_ = !in_;
+  }
+
+  GzPointSource(const GzPointSource &) = delete;
+  GzPointSource &operator=(const GzPointSource &) = delete;
+
+  ~GzPointSource() {
+    if (initialized_)
+      inflateEnd(&strm_);
+  }
+
+  std::size_t read(char *dst, std::size_t n) {
+    if (done_)
+      return 0;
+
+    strm_.next_out = reinterpret_cast<unsigned char *>(dst);
+    strm_.avail_out = static_cast<unsigned>(std::min<std::size_t>(n, UINT_MAX));
+    const unsigned requested = strm_.avail_out;
+
+    while (strm_.avail_out > 0) {
+      if (strm_.avail_in == 0 && !refill())
+        break;
+
+      const int ret = inflate(&strm_, Z_NO_FLUSH);
+
+      if (ret == Z_STREAM_END) {
+        // raw inflate stops before the trailer of the gzip member
+        if (raw_ && !skip(8))
+          break;
+
+        if (strm_.avail_in == 0 && !refill())
+          break;
+
+        // another gzip member follows, parse its header
+        raw_ = false;
+        inflateReset2(&strm_, 31);
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        std::cerr << "Error when inflating: "
+                  << (strm_.msg ? strm_.msg : "unknown") << '\n';
+        done_ = true;
+        break;
+      }
+    }
+
+    return requested - strm_.avail_out;
+  }
+
+private:
+  bool refill() {
+    in_.read(reinterpret_cast<char *>(input_.data()), input_.size());
+    strm_.avail_in = static_cast<unsigned>(in_.gcount());
+    strm_.next_in = input_.data();
+    done_ = strm_.avail_in == 0;
+    return !done_;
+  }
+
+  bool skip(unsigned n) {
+    while (n > 0) {
+      if (strm_.avail_in == 0 && !refill())
+        return false;
+
+      const unsigned k = std::min(n, strm_.avail_in);
+      strm_.next_in += k;
+      strm_.avail_in -= k;
+      n -= k;
+    }
+    return true;
+  }
+
+  std::ifstream in_;
+  std::vector<unsigned char> input_;
+  z_stream strm_{};
+  bool initialized_ = false;
+  bool raw_ = true;
+  bool done_ = false;
+};
+
+/// @brief Input stream over the games of a gzip file that start between the
+/// given access point and the uncompressed offset end, see GameRangeBuf.
+class GzRangeStream : public std::istream {
+public:
+  static constexpr std::uint64_t npos = GameRangeBuf<GzPointSource>::npos;
+
+  GzRangeStream(const std::string &file, const GzAccessPoint &point,
+                std::uint64_t end)
+      : std::istream(nullptr), buf_(point.out, end, file, point) {
+    rdbuf(&buf_);
+  }
+
+private:
+  GameRangeBuf<GzPointSource> buf_;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "external/chess.hpp"
+
+/// @brief Legality checks from the attack tables, for positions that need a
+/// yes or no rather than the list of moves of chess::movegen.
+namespace legal {
+
+/// @brief Squares strictly between two squares on a line, empty otherwise
+inline chess::Bitboard between(chess::Square a, chess::Square b) {
+  using namespace chess;
+
+  const Bitboard bb_a = Bitboard::fromSquare(a);
+  const Bitboard bb_b = Bitboard::fromSquare(b);
+
+  if (attacks::rook(a, Bitboard(0)) & bb_b)
+    return attacks::rook(a, bb_b) & attacks::rook(b, bb_a);
+
+  if (attacks::bishop(a, Bitboard(0)) & bb_b)
+    return attacks::bishop(a, bb_b) & attacks::bishop(b, bb_a);
+
+  return Bitboard(0);
+}
+
+/// @brief Pieces of a color attacking a square, given the occupancy
+inline chess::Bitboard attackers(const chess::Board &board, chess::Square sq,
+                                 chess::Color color, chess::Bitboard occ) {
+  using namespace chess;
+
+  const Bitboard queens = board.pieces(PieceType::QUEEN, color);
+
+  return (attacks::pawn(~color, sq) & board.pieces(PieceType::PAWN, color)) |
+         (attacks::knight(sq) & board.pieces(PieceType::KNIGHT, color)) |
+         (attacks::king(sq) & board.pieces(PieceType::KING, color)) |
+         (attacks::bishop(sq, occ) &
+          (board.pieces(PieceType::BISHOP, color) | queens)) |
+         (attacks::rook(sq, occ) &
+          (board.pieces(PieceType::ROOK, color) | queens));
+}
+
+/// @brief Check if the king of the side to move is attacked after another
+/// piece moved from one square to another.
+inline bool exposes_king(const chess::Board &board, chess::Square from,
+                         chess::Square to) {
+  using namespace chess;
+
+  const Color us = board.sideToMove();
+  const Bitboard occ = (board.occ() ^ Bitboard::fromSquare(from)) |
+                       Bitboard::fromSquare(to);
+
+  // a piece on the destination is captured
+  return bool(attackers(board, board.kingSq(us), ~us, occ) &
+              ~Bitboard::fromSquare(to));
+}
+
+/// @brief Check if the side to move has a legal move. Stops at the first one
+/// found, and tries the king and the pieces before the pawns. Positions with
+/// a capture en passant and chess960 positions, where castling may be the
+/// only move, are left to chess::movegen.
+inline bool has_move(const chess::Board &board) {
+  using namespace chess;
+
+  if (board.chess960() || board.enpassantSq() != Square::underlying::NO_SQ) {
+    Movelist moves;
+    movegen::legalmoves(moves, board);
+    return !moves.empty();
+  }
+
+  const Color us = board.sideToMove();
+  const Square king_sq = board.kingSq(us);
+  const Bitboard occ = board.occ();
+  const Bitboard own = board.us(us);
+  const Bitboard them = board.them(us);
+
+  // steps of the king, castling implies that a step is legal as well
+  const Bitboard without_king = occ ^ Bitboard::fromSquare(king_sq);
+  Bitboard steps = attacks::king(king_sq) & ~own;
+
+  while (steps) {
+    const Square to = steps.pop();
+
+    if (!attackers(board, to, ~us, without_king))
+      return true;
+  }
+
+  const Bitboard checkers = attackers(board, king_sq, ~us, occ);
+
+  if (checkers.count() > 1)
+    return false;
+
+  // in check, the checker has to be captured or blocked
+  Bitboard target = ~own;
+
+  if (checkers) {
+    const Square checker = Square(checkers.lsb());
+    target &= between(king_sq, checker) | checkers;
+  }
+
+  // pieces that may be pinned, their moves are checked one by one
+  Bitboard pinned;
+  Bitboard snipers =
+      (attacks::rook(king_sq, them) & (board.pieces(PieceType::ROOK, ~us) |
+                                       board.pieces(PieceType::QUEEN, ~us))) |
+      (attacks::bishop(king_sq, them) &
+       (board.pieces(PieceType::BISHOP, ~us) |
+        board.pieces(PieceType::QUEEN, ~us)));
+
+  while (snipers) {
+    const Bitboard line = between(king_sq, snipers.pop()) & occ;
+
+    if (line.count() == 1)
+      pinned |= line & own;
+  }
+
+  const auto any_legal = [&](Square from, Bitboard to_squares) {
+    if (!(pinned & Bitboard::fromSquare(from)))
+      return bool(to_squares);
+
+    while (to_squares) {
+      if (!exposes_king(board, from, to_squares.pop()))
+        return true;
+    }
+
+    return false;
+  };
+
+  for (Bitboard knights = board.pieces(PieceType::KNIGHT, us); knights;) {
+    const Square from = knights.pop();
+
+    if (any_legal(from, attacks::knight(from) & target))
+      return true;
+  }
+
+  for (Bitboard bishops = board.pieces(PieceType::BISHOP, us); bishops;) {
+    const Square from = bishops.pop();
+
+    if (any_legal(from, attacks::bishop(from, occ) & target))
+      return true;
+  }
+
+  for (Bitboard rooks = board.pieces(PieceType::ROOK, us); rooks;) {
+    const Square from = rooks.pop();
+
+    if (any_legal(from, attacks::rook(from, occ) & target))
+      return true;
+  }
+
+  for (Bitboard queens = board.pieces(PieceType::QUEEN, us); queens;) {
+    const Square from = queens.pop();
+
+    if (any_legal(from, attacks::queen(from, occ) & target))
+      return true;
+  }
+
+  const int forward = us == Color::WHITE ? 8 : -8;
+  const Rank double_push_rank =
+      us == Color::WHITE ? Rank::RANK_2 : Rank::RANK_7;
+
+  for (Bitboard pawns = board.pieces(PieceType::PAWN, us); pawns;) {
+    const Square from = pawns.pop();
+    Bitboard to_squares = attacks::pawn(us, from) & them;
+
+    const Bitboard one = Bitboard::fromSquare(from.index() + forward);
+
+    if (!(occ & one)) {
+      to_squares |= one;
+
+      if (from.rank() == double_push_rank) {
+        const Bitboard two = Bitboard::fromSquare(from.index() + 2 * forward);
+
+        if (!(occ & two))
+          to_squares |= two;
+      }
+    }
+
+    if (any_legal(from, to_squares & target))
+      return true;
+  }
+
+  return false;
+}
+
+} // namespace legal
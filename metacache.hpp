@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "fastpopular.hpp"
+
+/// @brief Metadata of tests extracted from their .json files, kept on disk
+/// between runs. Entries are stamped with the size and modification time of
+/// the .json file and are only used while it is unchanged.
+class MetaDataCache {
+public:
+  struct Entry {
+    std::uint64_t size = 0;
+    std::int64_t time = 0;
+    TestMetaData meta;
+  };
+
+  /// @brief Entries by the path of the .json file
+  std::unordered_map<std::string, Entry> entries;
+
+  /// @brief Stamp of a .json file, as stored with its entry
+  /// @return false if there is no such file
+  static bool stamp(const std::string &json_file, std::uint64_t &size,
+                    std::int64_t &time) {
+    std::error_code ec;
+    size = std::filesystem::file_size(json_file, ec);
+
+    if (ec)
+      return false;
+
+    time = std::filesystem::last_write_time(json_file, ec)
+               .time_since_epoch()
+               .count();
+
+    return !ec;
+  }
+
+  /// @brief Metadata of an unchanged .json file, nullptr if it is not cached
+  [[nodiscard]] const TestMetaData *find(const std::string &json_file,
+                                         std::uint64_t size,
+                                         std::int64_t time) const {
+    const auto it = entries.find(json_file);
+
+    if (it == entries.end() || it->second.size != size ||
+        it->second.time != time)
+      return nullptr;
+
+    return &it->second.meta;
+  }
+
+  bool save(const std::string &cache_file) const {
+    std::ofstream out(cache_file, std::ios::binary);
+
+    if (!out.is_open())
+      return false;
+
+    out.write(magic, sizeof(magic));
+    write(out, std::uint64_t(entries.size()));
+
+    for (const auto &[json_file, entry] : entries) {
+      const TestMetaData &meta = entry.meta;
+      const std::uint8_t flags = (meta.book.has_value() ? has_book : 0) |
+                                 (meta.sprt.has_value() ? has_sprt : 0) |
+                                 (meta.book_depth.has_value() ? has_depth : 0);
+
+      write_string(out, json_file);
+      write(out, entry.size);
+      write(out, entry.time);
+      write(out, flags);
+      write(out, std::int32_t(meta.book_depth.value_or(0)));
+      write_string(out, meta.book.value_or(""));
+    }
+
+    return bool(out);
+  }
+
+  /// @brief Read a cache written by save(), fails and leaves the cache empty
+  /// if the file is missing or invalid.
+  bool load(const std::string &cache_file) {
+    entries.clear();
+
+    std::ifstream in(cache_file, std::ios::binary);
+
+    if (!in.is_open())
+      return false;
+
+    char header[sizeof(magic)] = {};
+    std::uint64_t count = 0;
+
+    in.read(header, sizeof(header));
+    read(in, count);
+
+    if (!in || !std::equal(header, header + sizeof(header), magic))
+      return false;
+
+    for (std::uint64_t i = 0; i < count && in; ++i) {
+      std::string json_file, book;
+      Entry entry;
+      std::uint8_t flags = 0;
+      std::int32_t book_depth = 0;
+
+      read_string(in, json_file);
+      read(in, entry.size);
+      read(in, entry.time);
+      read(in, flags);
+      read(in, book_depth);
+      read_string(in, book);
+
+      if (flags & has_book)
+        entry.meta.book = std::move(book);
+      if (flags & has_sprt)
+        entry.meta.sprt = true;
+      if (flags & has_depth)
+        entry.meta.book_depth = book_depth;
+
+      entries[std::move(json_file)] = std::move(entry);
+    }
+
+    if (!in) {
+      entries.clear();
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  template <typename T> static void write(std::ofstream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T> static void read(std::ifstream &in, T &value) {
+    in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  }
+
+  static void write_string(std::ofstream &out, const std::string &str) {
+    write(out, std::uint32_t(str.size()));
+    out.write(str.data(), str.size());
+  }
+
+  static void read_string(std::ifstream &in, std::string &str) {
+    std::uint32_t size = 0;
+    read(in, size);
+
+    // paths and book names are short, anything else is a corrupt file
+    if (size > max_string) {
+      in.setstate(std::ios::failbit);
+      return;
+    }
+
+    str.resize(size);
+    in.read(str.data(), size);
+  }
+
+  static constexpr std::uint32_t max_string = 1 << 16;
+  static constexpr std::uint8_t has_book = 1, has_sprt = 2, has_depth = 4;
+  static constexpr char magic[8] = {'F', 'P', 'M', 'E', 'T', 'A', '0', '1'};
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "external/chess.hpp"
+#include "fastpopular.hpp"
+
+/// @brief Record of the binary output, a position with its zobrist key and
+/// count. Records follow a header of 16 bytes: the magic, the size of a record
+/// as 32 bit integer and 4 reserved bytes. Integers are in the byte order of
+/// the host, little endian on all common platforms.
+struct BinaryRecord {
+  /// @brief Position as encoded by chess::Board::Compact, without move
+  /// counters
+  chess::PackedBoard board;
+  std::uint64_t key;
+  std::uint64_t count;
+
+  static constexpr char magic[8] = {'F', 'P', 'B', 'I', 'N', '0', '0', '1'};
+
+  static void append_header(std::string &block) {
+    const std::uint32_t header[2] = {sizeof(BinaryRecord), 0};
+
+    block.append(magic, sizeof(magic));
+    block.append(reinterpret_cast<const char *>(header), sizeof(header));
+  }
+
+  void append_to(std::string &block) const {
+    block.append(reinterpret_cast<const char *>(this), sizeof(BinaryRecord));
+  }
+};
+
+static_assert(sizeof(BinaryRecord) == 40, "records are packed");
+
+/// @brief Output file written by a thread of its own. Threads producing
+/// output collect complete lines in buffers of their own and hand over the
+/// filled buffers, so they neither wait for the file nor for each other.
+/// Files ending in .gz are compressed by the writer thread.
+class OutputWriter {
+public:
+  /// @brief Size at which producers should hand over their buffers
+  static constexpr std::size_t block_size = std::size_t(1) << 20;
+
+  explicit OutputWriter(const std::string &filename) : blocks_(queue_size) {
+    const bool is_gz =
+        filename.size() >= 3 && filename.substr(filename.size() - 3) == ".gz";
+
+    if (is_gz) {
+      gz_ = gzopen(filename.c_str(), "wb");
+
+      if (gz_ != nullptr)
+        gzbuffer(gz_, 1 << 18);
+    } else {
+      out_.open(filename, std::ios::binary);
+    }
+
+    if (is_open())
+      thread_ = std::thread([this]() { run(); });
+  }
+
+  OutputWriter(const OutputWriter &) = delete;
+  OutputWriter &operator=(const OutputWriter &) = delete;
+
+  ~OutputWriter() { close(); }
+
+  [[nodiscard]] bool is_open() const {
+    return out_.is_open() || gz_ != nullptr;
+  }
+
+  /// @brief Hand over a buffer of complete lines, it is left empty.
+  void write(std::string &block) {
+    if (block.empty() || !thread_.joinable())
+      return;
+
+    blocks_.push(std::move(block));
+    block = std::string();
+  }
+
+  /// @brief Write the buffers handed over so far through to the file, so
+  /// that readers of the file see complete blocks.
+  void flush() {
+    if (thread_.joinable())
+      // an empty block asks the writer to flush
+      blocks_.push(std::string());
+  }
+
+  /// @brief Write the buffers handed over and close the file.
+  /// @return false if the file could not be written completely
+  bool close() {
+    if (!thread_.joinable())
+      return !failed_;
+
+    blocks_.close();
+    thread_.join();
+
+    if (gz_ != nullptr) {
+      if (gzclose(gz_) != Z_OK)
+        failed_ = true;
+      gz_ = nullptr;
+    } else {
+      out_.close();
+      if (out_.fail())
+        failed_ = true;
+    }
+
+    return !failed_;
+  }
+
+  /// @brief Check if writing to the file failed, the writer then drops the
+  /// buffers handed over.
+  [[nodiscard]] bool failed() const { return failed_; }
+
+private:
+  void run() {
+    std::string block;
+
+    // after an error, buffers are still taken so producers do not wait
+    while (blocks_.pop(block)) {
+      if (failed_)
+        continue;
+
+      if (block.empty()) {
+        if (gz_ != nullptr)
+          failed_ = gzflush(gz_, Z_SYNC_FLUSH) != Z_OK;
+        else
+          failed_ = !out_.flush();
+        continue;
+      }
+
+      if (gz_ == nullptr) {
+        failed_ = !out_.write(block.data(), block.size());
+        continue;
+      }
+
+      for (std::size_t done = 0; done < block.size() && !failed_;) {
+        const unsigned len = static_cast<unsigned>(
+            std::min<std::size_t>(block.size() - done, INT_MAX));
+
+        if (gzwrite(gz_, block.data() + done, len) <= 0)
+          failed_ = true;
+
+        done += len;
+      }
+    }
+  }
+
+  // filled buffers waiting to be written, producers wait if the file falls
+  // behind
+  static constexpr std::size_t queue_size = 64;
+
+  std::ofstream out_;
+  gzFile gz_ = nullptr;
+  std::atomic<bool> failed_ = false;
+  BoundedQueue<std::string> blocks_;
+  std::thread thread_;
+};
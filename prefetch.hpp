@@ -0,0 +1,423 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define FASTPOPULAR_IO_URING
+#endif
+#endif
+
+#include "external/threadpool.hpp"
+#include "fastpopular.hpp"
+
+/// @brief Contents of a file read ahead of its analysis
+struct FileData {
+  std::string path;
+  /// @brief Position of the file in its FileQueue
+  std::size_t index = 0;
+  std::vector<char> data;
+  /// @brief false if the file was not read ahead, e.g. because it is too large
+  bool loaded = false;
+};
+
+/// @brief Read a whole file into memory, skipping files above max_size.
+[[nodiscard]] inline FileData read_file(const std::string &path,
+                                        std::uint64_t max_size) {
+  FileData file;
+  file.path = path;
+
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+
+  if (!in.is_open())
+    return file;
+
+  const std::uint64_t size = in.tellg();
+
+  if (size > max_size)
+    return file;
+
+  file.data.resize(size);
+  in.seekg(0);
+  in.read(file.data.data(), size);
+  file.loaded = bool(in);
+
+  return file;
+}
+
+#ifdef FASTPOPULAR_IO_URING
+
+/// @brief Minimal io_uring submission and completion queue, using the raw
+/// system calls, for reads of whole files.
+class IoUring {
+public:
+  explicit IoUring(unsigned entries) {
+    io_uring_params params{};
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+    if (fd_ < 0)
+      return;
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+    sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    cq_ptr_ = (params.features & IORING_FEAT_SINGLE_MMAP)
+                  ? sq_ptr_
+                  : ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+
+    if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes == MAP_FAILED) {
+      if (sqes != MAP_FAILED)
+        ::munmap(sqes, sqes_size_);
+      release();
+      return;
+    }
+
+    char *sq = static_cast<char *>(sq_ptr_);
+    char *cq = static_cast<char *>(cq_ptr_);
+
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  }
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  ~IoUring() {
+    if (sqes_ != nullptr)
+      ::munmap(sqes_, sqes_size_);
+    release();
+  }
+
+  [[nodiscard]] bool is_open() const { return sqes_ != nullptr; }
+
+  /// @brief Submit a read of len bytes at offset of fd into buf
+  bool read(int fd, char *buf, unsigned len, std::uint64_t offset,
+            std::uint64_t user_data) {
+    const unsigned tail = *sq_tail_;
+
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return false;
+
+    const unsigned index = tail & sq_mask_;
+    io_uring_sqe &sqe = sqes_[index];
+
+    sqe = io_uring_sqe{};
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(buf);
+    sqe.len = len;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    if (enter(1, 0, 0) > 0)
+      return true;
+
+    // the kernel may have taken the entry nonetheless, it then completes
+    if (__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) != tail)
+      return true;
+
+    // withdraw the entry, a later submission would read into a stale buffer
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    return false;
+  }
+
+  /// @brief Wait for the next completion
+  bool wait(io_uring_cqe &cqe) {
+    const unsigned head = *cq_head_;
+
+    while (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+        return false;
+    }
+
+    cqe = cqes_[head & cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+  }
+
+private:
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+
+    do {
+      ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, to_submit,
+                                     min_complete, flags, nullptr, 0));
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+  }
+
+  void release() {
+    if (cq_ptr_ != nullptr && cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+      ::munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_ != nullptr && sq_ptr_ != MAP_FAILED)
+      ::munmap(sq_ptr_, sq_size_);
+    if (fd_ >= 0)
+      ::close(fd_);
+
+    sq_ptr_ = cq_ptr_ = nullptr;
+    sqes_ = nullptr;
+    fd_ = -1;
+  }
+
+  int fd_ = -1;
+
+  void *sq_ptr_ = nullptr;
+  void *cq_ptr_ = nullptr;
+  std::size_t sq_size_ = 0, cq_size_ = 0, sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr, *sq_tail_ = nullptr, *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0, sq_entries_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+
+  unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+};
+
+#endif
+
+/// @brief Takes the next files of a queue and reads them ahead of time,
+/// keeping up to depth reads, and up to max_ahead bytes, in flight. Reads are
+/// submitted to io_uring where available, and otherwise to a thread pool, or
+/// done synchronously without one.
+class FilePrefetcher {
+public:
+  /// @brief Files above this size are left to be streamed by the caller
+  static constexpr std::uint64_t max_size = std::uint64_t(1) << 28;
+
+  /// @brief Limit of the bytes read ahead, the queue hands out the largest
+  /// files first
+  static constexpr std::uint64_t max_ahead = std::uint64_t(1) << 28;
+
+  FilePrefetcher(FileQueue &files, std::size_t depth, ThreadPool *io_pool)
+      : files_(files), depth_(depth), io_pool_(io_pool) {
+#ifdef FASTPOPULAR_IO_URING
+    if (depth_ > 0) {
+      ring_ = std::make_unique<IoUring>(static_cast<unsigned>(depth_));
+
+      if (!ring_->is_open())
+        ring_.reset();
+    }
+#endif
+    issue();
+  }
+
+  FilePrefetcher(const FilePrefetcher &) = delete;
+  FilePrefetcher &operator=(const FilePrefetcher &) = delete;
+
+  /// @brief Check if reads go to io_uring, otherwise a thread pool is needed
+  /// to read asynchronously.
+  [[nodiscard]] static bool uses_io_uring() {
+#ifdef FASTPOPULAR_IO_URING
+    return IoUring(1).is_open();
+#else
+    return false;
+#endif
+  }
+
+  ~FilePrefetcher() {
+    // the kernel may still write into the buffers of pending reads
+    for (auto &pending : queue_)
+      complete(*pending);
+  }
+
+  /// @brief Contents of the next file taken from the queue, waits for its
+  /// read. If nothing was read ahead, the file is taken from the queue when
+  /// available and returned not loaded.
+  /// @return false if no files are left
+  bool next(FileData &file) {
+    if (queue_.empty()) {
+      std::size_t index;
+      if (!files_.next(index))
+        return false;
+
+      file = FileData{};
+      file.path = files_[index];
+      file.index = index;
+
+      // files queued meanwhile are read ahead again
+      issue();
+      return true;
+    }
+
+    std::unique_ptr<Pending> pending = std::move(queue_.front());
+    queue_.pop_front();
+    bytes_ahead_ -= pending->bytes;
+
+    complete(*pending);
+    issue();
+
+    file = std::move(pending->file);
+    return true;
+  }
+
+private:
+  struct Pending {
+    FileData file;
+    // size of the file when queued, counted against max_ahead
+    std::uint64_t bytes = 0;
+    std::future<FileData> future;
+#ifdef FASTPOPULAR_IO_URING
+    int fd = -1;
+    std::uint64_t done = 0;
+    bool in_flight = false;
+#endif
+  };
+
+  /// @brief Start reading upcoming files, up to depth_ of them and while the
+  /// next file fits into max_ahead. Only files already queued are taken, an
+  /// open queue may not get more for a while.
+  void issue() {
+    std::size_t index;
+
+    while (queue_.size() < depth_ &&
+           files_.try_next(index, max_ahead - bytes_ahead_)) {
+      auto pending = std::make_unique<Pending>();
+      pending->file.path = files_[index];
+      pending->file.index = index;
+      pending->bytes = files_.file_size(index);
+      bytes_ahead_ += pending->bytes;
+
+#ifdef FASTPOPULAR_IO_URING
+      if (ring_) {
+        start(*pending);
+        queue_.push_back(std::move(pending));
+        continue;
+      }
+#endif
+
+      if (io_pool_ != nullptr) {
+        auto promise = std::make_shared<std::promise<FileData>>();
+        pending->future = promise->get_future();
+
+        io_pool_->enqueue([promise, path = pending->file.path, index]() {
+          FileData file = read_file(path, max_size);
+          file.index = index;
+          promise->set_value(std::move(file));
+        });
+      } else {
+        pending->file = read_file(pending->file.path, max_size);
+        pending->file.index = index;
+      }
+
+      queue_.push_back(std::move(pending));
+    }
+  }
+
+  /// @brief Wait until the read of a file has finished
+  void complete(Pending &pending) {
+    if (pending.future.valid()) {
+      pending.file = pending.future.get();
+      return;
+    }
+
+#ifdef FASTPOPULAR_IO_URING
+    while (pending.in_flight) {
+      io_uring_cqe cqe;
+
+      if (!ring_->wait(cqe))
+        break;
+
+      reap(*reinterpret_cast<Pending *>(cqe.user_data), cqe.res);
+    }
+
+    if (pending.fd >= 0) {
+      ::close(pending.fd);
+      pending.fd = -1;
+    }
+#endif
+  }
+
+#ifdef FASTPOPULAR_IO_URING
+  void start(Pending &pending) {
+    pending.fd = ::open(pending.file.path.c_str(), O_RDONLY);
+
+    struct stat st;
+
+    if (pending.fd < 0 || ::fstat(pending.fd, &st) != 0 ||
+        std::uint64_t(st.st_size) > max_size)
+      return;
+
+    pending.file.data.resize(st.st_size);
+    pending.file.loaded = st.st_size == 0;
+
+    submit(pending);
+  }
+
+  void submit(Pending &pending) {
+    auto &data = pending.file.data;
+    const std::uint64_t left = data.size() - pending.done;
+
+    if (left == 0) {
+      pending.file.loaded = true;
+      return;
+    }
+
+    pending.in_flight = ring_->read(
+        pending.fd, data.data() + pending.done,
+        static_cast<unsigned>(std::min<std::uint64_t>(left, 1 << 30)),
+        pending.done, reinterpret_cast<std::uint64_t>(&pending));
+  }
+
+  void reap(Pending &pending, int res) {
+    pending.in_flight = false;
+
+    if (res < 0) {
+      // leave the file to the caller
+      pending.file.data.clear();
+    } else if (res == 0) {
+      // the file was truncated in the meantime
+      pending.file.data.resize(pending.done);
+      pending.file.loaded = true;
+    } else {
+      pending.done += res;
+      submit(pending);
+    }
+  }
+
+  std::unique_ptr<IoUring> ring_;
+#endif
+
+  FileQueue &files_;
+  const std::size_t depth_;
+  ThreadPool *io_pool_;
+
+  std::deque<std::unique_ptr<Pending>> queue_;
+  std::uint64_t bytes_ahead_ = 0;
+};
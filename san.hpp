@@ -0,0 +1,169 @@
+#pragma once
+
+#include <string_view>
+
+#include "external/chess.hpp"
+#include "legal.hpp"
+
+/// @brief Decoding of SAN moves from the attack tables, without generating
+/// the legal moves. The origin of the piece moved follows from its
+/// destination and the disambiguation given, pins are only checked if several
+/// pieces can reach the destination. Castling, promotions, en passant and
+/// anything unexpected are left to chess::uci::parseSan.
+namespace san {
+
+/// @brief Decode a SAN move, like chess::uci::parseSan.
+/// @param moves scratch space for chess::uci::parseSan
+inline chess::Move parse(const chess::Board &board, std::string_view move,
+                         chess::Movelist &moves) {
+  using namespace chess;
+
+  const auto is_file = [](char c) { return c >= 'a' && c <= 'h'; };
+  const auto is_rank = [](char c) { return c >= '1' && c <= '8'; };
+
+  std::string_view san = move;
+
+  // check and annotation symbols
+  while (!san.empty() && (san.back() == '+' || san.back() == '#' ||
+                          san.back() == '!' || san.back() == '?'))
+    san.remove_suffix(1);
+
+  // castling and promotions do not end with the destination
+  if (san.size() < 2 || !is_file(san[san.size() - 2]) || !is_rank(san.back()))
+    return uci::parseSan(board, move, moves);
+
+  PieceType piece = PieceType::PAWN;
+
+  switch (san[0]) {
+  case 'N':
+    piece = PieceType::KNIGHT;
+    break;
+  case 'B':
+    piece = PieceType::BISHOP;
+    break;
+  case 'R':
+    piece = PieceType::ROOK;
+    break;
+  case 'Q':
+    piece = PieceType::QUEEN;
+    break;
+  case 'K':
+    piece = PieceType::KING;
+    break;
+  default:
+    break;
+  }
+
+  const Square to(File(san[san.size() - 2] - 'a'), Rank(san.back() - '1'));
+
+  // disambiguation and capture sign, between the piece and the destination
+  const std::size_t start = piece == PieceType::PAWN ? 0 : 1;
+  std::string_view hint = san.substr(start, san.size() - 2 - start);
+
+  const bool capture = !hint.empty() && hint.back() == 'x';
+
+  if (capture)
+    hint.remove_suffix(1);
+
+  int from_file = -1, from_rank = -1;
+
+  if (!hint.empty() && is_file(hint[0])) {
+    from_file = hint[0] - 'a';
+    hint.remove_prefix(1);
+  }
+
+  if (!hint.empty() && is_rank(hint[0])) {
+    from_rank = hint[0] - '1';
+    hint.remove_prefix(1);
+  }
+
+  const Color us = board.sideToMove();
+  const Bitboard target = Bitboard::fromSquare(to);
+
+  // the destination must agree with the capture sign, which also leaves
+  // captures en passant to the common path
+  if (!hint.empty() || bool(board.us(us) & target) ||
+      capture != bool(board.them(us) & target))
+    return uci::parseSan(board, move, moves);
+
+  const Bitboard own = board.pieces(piece, us);
+  Bitboard candidates;
+
+  switch (piece.internal()) {
+  case PieceType::PAWN: {
+    const int forward = us == Color::WHITE ? 8 : -8;
+    const int double_push_rank = us == Color::WHITE ? 3 : 4;
+
+    // promotions, or pawns that cannot get there, pawns capturing name their
+    // file only
+    if (to.rank() == Rank::RANK_1 || to.rank() == Rank::RANK_8 ||
+        from_rank >= 0 || capture == (from_file < 0))
+      return uci::parseSan(board, move, moves);
+
+    if (capture) {
+      candidates = attacks::pawn(~us, to) & own;
+    } else {
+      const int one = to.index() - forward;
+
+      if (own & Bitboard::fromSquare(one))
+        candidates = Bitboard::fromSquare(one);
+      else if (int(to.rank()) == double_push_rank &&
+               !(board.occ() & Bitboard::fromSquare(one)))
+        candidates = own & Bitboard::fromSquare(one - forward);
+    }
+    break;
+  }
+  case PieceType::KNIGHT:
+    candidates = attacks::knight(to) & own;
+    break;
+  case PieceType::BISHOP:
+    candidates = attacks::bishop(to, board.occ()) & own;
+    break;
+  case PieceType::ROOK:
+    candidates = attacks::rook(to, board.occ()) & own;
+    break;
+  case PieceType::QUEEN:
+    candidates = attacks::queen(to, board.occ()) & own;
+    break;
+  default:
+    candidates = attacks::king(to) & own;
+    break;
+  }
+
+  // origins of the disambiguation, usually a single one
+  Bitboard origins;
+
+  while (candidates) {
+    const Square from = candidates.pop();
+
+    if ((from_file < 0 || int(from.file()) == from_file) &&
+        (from_rank < 0 || int(from.rank()) == from_rank))
+      origins |= Bitboard::fromSquare(from);
+  }
+
+  if (origins.count() == 1)
+    return Move::make(Square(origins.lsb()), to);
+
+  if (origins.empty())
+    return uci::parseSan(board, move, moves);
+
+  // several pieces reach the destination, all but one must be pinned
+  Move found = Move::NO_MOVE;
+
+  while (origins) {
+    const Square from = origins.pop();
+
+    if (legal::exposes_king(board, from, to))
+      continue;
+
+    // ambiguous, reported by the common path
+    if (found != Move::NO_MOVE)
+      return uci::parseSan(board, move, moves);
+
+    found = Move::make(from, to);
+  }
+
+  return found != Move::NO_MOVE ? found : uci::parseSan(board, move, moves);
+}
+
+} // namespace san
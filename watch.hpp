@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/inotify.h>)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define FASTPOPULAR_INOTIFY
+#endif
+#endif
+
+#include "fastpopular.hpp"
+
+#ifdef FASTPOPULAR_INOTIFY
+
+/// @brief Watches a directory tree with inotify for .pgn(.gz) files that are
+/// completely written, or moved into the tree.
+class DirectoryWatcher {
+public:
+  DirectoryWatcher(const std::string &path, bool recursive)
+      : fd_(::inotify_init1(IN_CLOEXEC)), recursive_(recursive) {
+    if (fd_ >= 0)
+      add_watch(path);
+  }
+
+  DirectoryWatcher(const DirectoryWatcher &) = delete;
+  DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+
+  ~DirectoryWatcher() {
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  [[nodiscard]] bool is_open() const { return fd_ >= 0; }
+
+  /// @brief Wait up to timeout for files, and pass the path and size of each
+  /// file found to on_file.
+  template <typename OnFile>
+  void poll(std::chrono::milliseconds timeout, OnFile &&on_file) {
+    pollfd pfd{fd_, POLLIN, 0};
+
+    if (::poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0)
+      return;
+
+    alignas(inotify_event) char buffer[1 << 16];
+    const ssize_t len = ::read(fd_, buffer, sizeof(buffer));
+
+    for (ssize_t offset = 0; offset < len;) {
+      const auto *event =
+          reinterpret_cast<const inotify_event *>(buffer + offset);
+      offset += sizeof(inotify_event) + event->len;
+
+      const auto dir = dirs_.find(event->wd);
+
+      if (event->len == 0 || dir == dirs_.end())
+        continue;
+
+      const std::string &parent = dir->second;
+      const std::string path =
+          (parent.back() == '/' ? parent : parent + '/') + event->name;
+
+      if (event->mask & IN_ISDIR) {
+        if (!recursive_)
+          continue;
+
+        add_watch(path);
+
+        // a directory moved into the tree brings complete files along, the
+        // files of a new one are reported once written
+        if (event->mask & IN_MOVED_TO)
+          walk_files(path, true, 1, on_file);
+      } else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+                 is_pgn_name(event->name)) {
+        std::error_code ec;
+        const std::uint64_t size = std::filesystem::file_size(path, ec);
+
+        if (!ec)
+          on_file(path, size);
+      }
+    }
+  }
+
+private:
+  /// @brief Watch a directory, and its subdirectories if recursive
+  void add_watch(const std::string &dir) {
+    constexpr std::uint32_t mask =
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR;
+    const int wd = ::inotify_add_watch(fd_, dir.c_str(), mask);
+
+    if (wd < 0) {
+      std::cout << "Warning: Cannot watch directory " << dir << std::endl;
+      return;
+    }
+
+    dirs_[wd] = dir;
+
+    if (!recursive_)
+      return;
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+      if (entry.is_directory(ec))
+        add_watch(entry.path().string());
+    }
+  }
+
+  const int fd_;
+  const bool recursive_;
+  std::unordered_map<int, std::string> dirs_;
+};
+
+#endif